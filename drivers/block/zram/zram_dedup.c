@@ -0,0 +1,236 @@
+/*
+ * Content deduplication for zram
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket per this many pages of disksize, within limits */
+#define ZRAM_HASH_SHIFT		4
+#define ZRAM_HASH_SIZE_MIN	(1 << 10)
+#define ZRAM_HASH_SIZE_MAX	(1UL << 31)
+
+u64 zram_dedup_dup_size(struct zram *zram)
+{
+	return (u64)atomic64_read(&zram->stats.dup_data_size);
+}
+
+u64 zram_dedup_meta_size(struct zram *zram)
+{
+	return (u64)atomic64_read(&zram->stats.meta_data_size);
+}
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash(mem, PAGE_SIZE, 0);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram_meta *meta, u32 checksum)
+{
+	return &meta->hash[checksum % meta->hash_size];
+}
+
+/*
+ * Checksums collide, so confirm a candidate by comparing the whole page.
+ * @buf is a PAGE_SIZE scratch buffer for decompressing the candidate.
+ */
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			     unsigned char *mem, unsigned char *buf)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned char *cmem;
+	bool match = false;
+
+	cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+	if (entry->len == PAGE_SIZE)
+		match = !memcmp(mem, cmem, PAGE_SIZE);
+	else if (!zcomp_decompress(zram->comp, cmem, entry->len, buf))
+		match = !memcmp(mem, buf, PAGE_SIZE);
+	zs_unmap_object(meta->mem_pool, entry->handle);
+
+	return match;
+}
+
+/**
+ * zram_dedup_find - look up a stored object with the same content as @mem
+ * @zram:	the device
+ * @mem:	uncompressed page about to be written
+ * @checksum:	zram_dedup_checksum() of @mem
+ * @buf:	PAGE_SIZE scratch buffer
+ *
+ * Returns the matching entry with an extra reference taken on behalf of
+ * the caller's slot, or NULL if there is none.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, unsigned char *mem,
+				   u32 checksum, unsigned char *buf)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, checksum);
+	struct zram_entry *entry, *found = NULL;
+	struct rb_node *rb_node;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		rb_node = checksum < entry->checksum ?
+			rb_node->rb_left : rb_node->rb_right;
+	}
+	if (!rb_node)
+		goto out;
+
+	/* entries with the same checksum are adjacent in the tree */
+	while (rb_prev(rb_node)) {
+		entry = rb_entry(rb_prev(rb_node), struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		rb_node = rb_prev(rb_node);
+	}
+
+	for (; rb_node; rb_node = rb_next(rb_node)) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		if (zram_dedup_match(zram, entry, mem, buf)) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+out:
+	spin_unlock(&hash->lock);
+
+	if (found)
+		atomic64_add(found->len, &zram->stats.dup_data_size);
+	return found;
+}
+
+/**
+ * zram_dedup_add - index a newly stored object
+ * @zram:	the device
+ * @handle:	zsmalloc handle of the compressed object
+ * @len:	compressed length
+ * @checksum:	checksum of the uncompressed page
+ *
+ * Returns the new entry, holding one reference for the caller's slot, or
+ * NULL if the entry could not be allocated.
+ */
+struct zram_entry *zram_dedup_add(struct zram *zram, unsigned long handle,
+				  unsigned int len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, checksum);
+	struct zram_entry *entry, *node;
+	struct rb_node **rb_node, *parent = NULL;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		node = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < node->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	atomic64_add(sizeof(*entry), &zram->stats.meta_data_size);
+	return entry;
+}
+
+/**
+ * zram_dedup_put - drop a slot's reference to @entry
+ *
+ * Returns true if this was the last reference, in which case the
+ * compressed object has been freed as well.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount) {
+		atomic64_sub(entry->len, &zram->stats.dup_data_size);
+		return false;
+	}
+
+	zs_free(zram->meta->mem_pool, entry->handle);
+	kfree(entry);
+	atomic64_sub(sizeof(*entry), &zram->stats.meta_data_size);
+	return true;
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	size_t i;
+
+	meta->hash_size = num_pages >> ZRAM_HASH_SHIFT;
+	meta->hash_size = min_t(size_t, ZRAM_HASH_SIZE_MAX, meta->hash_size);
+	meta->hash_size = max_t(size_t, ZRAM_HASH_SIZE_MIN, meta->hash_size);
+	meta->hash = vzalloc(meta->hash_size * sizeof(struct zram_hash));
+	if (!meta->hash) {
+		pr_err("Error allocating zram entry hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < meta->hash_size; i++) {
+		spin_lock_init(&meta->hash[i].lock);
+		meta->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+/* Release every object still indexed; called once all I/O is done */
+void zram_dedup_fini(struct zram_meta *meta)
+{
+	struct zram_entry *entry;
+	struct rb_node *rb_node;
+	size_t i;
+
+	if (!meta->hash)
+		return;
+
+	for (i = 0; i < meta->hash_size; i++) {
+		while ((rb_node = rb_first(&meta->hash[i].rb_root))) {
+			entry = rb_entry(rb_node, struct zram_entry, rb_node);
+			rb_erase(rb_node, &meta->hash[i].rb_root);
+			zs_free(meta->mem_pool, entry->handle);
+			kfree(entry);
+		}
+	}
+
+	vfree(meta->hash);
+	meta->hash = NULL;
+	meta->hash_size = 0;
+}
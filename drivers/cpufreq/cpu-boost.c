@@ -15,370 +15,431 @@
 
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/notifier.h>
-#include <linux/cpufreq.h>
 #include <linux/cpu.h>
 #include <linux/sched.h>
 #include <linux/jiffies.h>
-#include <linux/kthread.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/input.h>
 #include <linux/time.h>
 
-struct cpu_sync {
-	struct task_struct *thread;
-	wait_queue_head_t sync_wq;
-	struct delayed_work boost_rem;
-	int cpu;
-	spinlock_t lock;
-	bool pending;
-	int src_cpu;
-	unsigned int boost_min;
-	unsigned int input_boost_min;
-	unsigned int task_load;
-	unsigned int input_boost_freq;
-};
-
-static DEFINE_PER_CPU(struct cpu_sync, sync_info);
-static struct workqueue_struct *cpu_boost_wq;
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpu_boost.h>
 
-static struct work_struct input_boost_work;
+/*
+ * A boost profile describes what one use case (touch, app launch, fling,
+ * ...) needs: a frequency floor per CPU, how long a boost lasts unless
+ * told otherwise, and whether the scheduler should place tasks on the
+ * big cluster meanwhile.
+ *
+ * Any number of profiles may be active at once. Each CPU gets the
+ * highest floor of the active profiles, handed to the scheduler with
+ * sched_set_freq_floor(); the governor then sees it in the CPU's busy
+ * time, without the policy being re-evaluated.
+ *
+ * Profiles are defined and triggered by writing one command at a time to
+ * the "boost" parameter:
+ *
+ *	define <name> <duration_ms> <sched_boost> <freq>|<cpu:freq>...
+ *	start <name> [<duration_ms>]
+ *	stop <name>
+ *
+ * A start with a non-zero duration boosts until that much time has
+ * passed since the last such start. A start with a zero duration takes a
+ * hold that lasts until a matching stop. Reading "boost" lists every
+ * profile with its state and the time it has spent active.
+ *
+ * The "input" profile is built in and started on input events. It is
+ * also set up by the input_boost_freq, input_boost_ms and
+ * sched_boost_on_input parameters.
+ */
+#define MAX_BOOST_PROFILES	8
+#define BOOST_NAME_LEN		16
+
+struct boost_profile {
+	char name[BOOST_NAME_LEN];
+	unsigned int freq[NR_CPUS];
+	unsigned int duration_ms;
+	bool sched_boost;
+
+	/* protected by boost_lock */
+	int holds;
+	bool timed;
+	unsigned long expires;
+	struct delayed_work expire;
+	u64 start_us;
+	u64 residency_us;
+	unsigned long nr_boosts;
+};
 
-static unsigned int boost_ms;
-module_param(boost_ms, uint, 0644);
+static DEFINE_MUTEX(boost_lock);
+static struct boost_profile profiles[MAX_BOOST_PROFILES] = {
+	[0] = { .name = "input", .duration_ms = 40 },
+};
+static int nr_profiles = 1;
+static bool sched_boost_active;
 
-static unsigned int sync_threshold;
-module_param(sync_threshold, uint, 0644);
+static struct workqueue_struct *cpu_boost_wq;
 
+#define input_profile (&profiles[0])
 static bool input_boost_enabled;
+static struct work_struct input_boost_work;
+static u64 last_input_time;
+#define MIN_INPUT_INTERVAL (150 * USEC_PER_MSEC)
 
-static unsigned int input_boost_ms = 40;
-module_param(input_boost_ms, uint, 0644);
-
-static unsigned int migration_load_threshold = 15;
-module_param(migration_load_threshold, uint, 0644);
+module_param_named(input_boost_ms, profiles[0].duration_ms, uint, 0644);
+module_param_named(sched_boost_on_input, profiles[0].sched_boost, bool, 0644);
 
-static bool load_based_syncs;
-module_param(load_based_syncs, bool, 0644);
+static inline bool profile_active(struct boost_profile *p)
+{
+	return p->holds || p->timed;
+}
 
-static bool sched_boost_on_input;
-module_param(sched_boost_on_input, bool, 0644);
+static struct boost_profile *find_profile(const char *name)
+{
+	int i;
 
-static bool sched_boost_active;
+	for (i = 0; i < nr_profiles; i++)
+		if (!strcmp(profiles[i].name, name))
+			return &profiles[i];
 
-static struct delayed_work input_boost_rem;
-static u64 last_input_time;
-#define MIN_INPUT_INTERVAL (150 * USEC_PER_MSEC)
+	return NULL;
+}
 
-static int set_input_boost_freq(const char *buf, const struct kernel_param *kp)
+/* Hand the combined floors of the active profiles to the scheduler */
+static void boost_update(void)
 {
-	int i, ntokens = 0;
-	unsigned int val, cpu;
-	const char *cp = buf;
-	bool enabled = false;
+	struct boost_profile *p;
+	unsigned int floor;
+	bool sched_boost = false;
+	int cpu, i;
 
-	while ((cp = strpbrk(cp + 1, " :")))
-		ntokens++;
+	for_each_possible_cpu(cpu) {
+		floor = 0;
+		for (i = 0; i < nr_profiles; i++) {
+			p = &profiles[i];
+			if (profile_active(p))
+				floor = max(floor, p->freq[cpu]);
+		}
+		sched_set_freq_floor(cpu, floor);
+	}
 
-	/* single number: apply to all CPUs */
-	if (!ntokens) {
-		if (sscanf(buf, "%u\n", &val) != 1)
-			return -EINVAL;
-		for_each_possible_cpu(i)
-			per_cpu(sync_info, i).input_boost_freq = val;
-		goto check_enable;
+	for (i = 0; i < nr_profiles; i++) {
+		p = &profiles[i];
+		if (profile_active(p) && p->sched_boost)
+			sched_boost = true;
 	}
 
-	/* CPU:value pair */
-	if (!(ntokens % 2))
-		return -EINVAL;
+	if (sched_boost == sched_boost_active)
+		return;
 
-	cp = buf;
-	for (i = 0; i < ntokens; i += 2) {
-		if (sscanf(cp, "%u:%u", &cpu, &val) != 2)
-			return -EINVAL;
-		if (cpu > num_possible_cpus())
-			return -EINVAL;
+	if (sched_set_boost(sched_boost))
+		pr_err("HMP boost %s failed\n", sched_boost ? "enable" : "disable");
+	else
+		sched_boost_active = sched_boost;
+}
 
-		per_cpu(sync_info, cpu).input_boost_freq = val;
-		cp = strchr(cp, ' ');
-		cp++;
+/* Account residency across an inactive <-> active transition of @p */
+static void boost_account(struct boost_profile *p, bool was_active)
+{
+	u64 now = ktime_to_us(ktime_get());
+	bool active = profile_active(p);
+
+	if (!was_active && active) {
+		p->start_us = now;
+		p->nr_boosts++;
+	} else if (was_active && !active) {
+		p->residency_us += now - p->start_us;
+		trace_cpu_boost_end(p->name, now - p->start_us);
 	}
+}
 
-check_enable:
-	for_each_possible_cpu(i) {
-		if (per_cpu(sync_info, i).input_boost_freq) {
-			enabled = true;
-			break;
-		}
+static void boost_start(struct boost_profile *p, unsigned int duration_ms)
+{
+	bool was_active = profile_active(p);
+
+	if (duration_ms) {
+		p->timed = true;
+		p->expires = jiffies + msecs_to_jiffies(duration_ms);
+		mod_delayed_work(cpu_boost_wq, &p->expire,
+				 msecs_to_jiffies(duration_ms));
+	} else {
+		p->holds++;
 	}
-	input_boost_enabled = enabled;
 
-	return 0;
+	trace_cpu_boost_start(p->name, duration_ms, p->holds);
+	boost_account(p, was_active);
+	if (!was_active)
+		boost_update();
 }
 
-static int get_input_boost_freq(char *buf, const struct kernel_param *kp)
+static int boost_stop(struct boost_profile *p)
 {
-	int cnt = 0, cpu;
-	struct cpu_sync *s;
+	if (p->holds) {
+		p->holds--;
+	} else if (p->timed) {
+		p->timed = false;
+		cancel_delayed_work(&p->expire);
+	} else {
+		return -EINVAL;
+	}
 
-	for_each_possible_cpu(cpu) {
-		s = &per_cpu(sync_info, cpu);
-		cnt += snprintf(buf + cnt, PAGE_SIZE - cnt,
-				"%d:%u ", cpu, s->input_boost_freq);
+	if (!profile_active(p)) {
+		boost_account(p, true);
+		boost_update();
 	}
-	cnt += snprintf(buf + cnt, PAGE_SIZE - cnt, "\n");
-	return cnt;
-}
 
-static const struct kernel_param_ops param_ops_input_boost_freq = {
-	.set = set_input_boost_freq,
-	.get = get_input_boost_freq,
-};
-module_param_cb(input_boost_freq, &param_ops_input_boost_freq, NULL, 0644);
+	return 0;
+}
 
-/*
- * The CPUFREQ_ADJUST notifier is used to override the current policy min to
- * make sure policy min >= boost_min. The cpufreq framework then does the job
- * of enforcing the new policy.
- *
- * The sync kthread needs to run on the CPU in question to avoid deadlocks in
- * the wake up code. Achieve this by binding the thread to the respective
- * CPU. But a CPU going offline unbinds threads from that CPU. So, set it up
- * again each time the CPU comes back up. We can use CPUFREQ_START to figure
- * out a CPU is coming online instead of registering for hotplug notifiers.
- */
-static int boost_adjust_notify(struct notifier_block *nb, unsigned long val,
-				void *data)
+static void do_boost_expire(struct work_struct *work)
 {
-	struct cpufreq_policy *policy = data;
-	unsigned int cpu = policy->cpu;
-	struct cpu_sync *s = &per_cpu(sync_info, cpu);
-	unsigned int b_min = s->boost_min;
-	unsigned int ib_min = s->input_boost_min;
-	unsigned int min;
-
-	switch (val) {
-	case CPUFREQ_ADJUST:
-		if (!b_min && !ib_min)
-			break;
-
-		min = max(b_min, ib_min);
+	struct boost_profile *p = container_of(work, struct boost_profile,
+					       expire.work);
 
-		pr_debug("CPU%u policy min before boost: %u kHz\n",
-			 cpu, policy->min);
-		pr_debug("CPU%u boost min: %u kHz\n", cpu, min);
+	mutex_lock(&boost_lock);
 
-		cpufreq_verify_within_limits(policy, min, UINT_MAX);
+	if (!p->timed)
+		goto out;
 
-		pr_debug("CPU%u policy min after boost: %u kHz\n",
-			 cpu, policy->min);
-		break;
-
-	case CPUFREQ_START:
-		set_cpus_allowed(s->thread, *cpumask_of(cpu));
-		break;
+	/* Restarted after this work was already on its way */
+	if (time_before(jiffies, p->expires)) {
+		queue_delayed_work(cpu_boost_wq, &p->expire,
+				   p->expires - jiffies);
+		goto out;
 	}
 
-	return NOTIFY_OK;
+	p->timed = false;
+	if (!profile_active(p)) {
+		boost_account(p, true);
+		boost_update();
+	}
+out:
+	mutex_unlock(&boost_lock);
 }
 
-static struct notifier_block boost_adjust_nb = {
-	.notifier_call = boost_adjust_notify,
-};
-
-static void do_boost_rem(struct work_struct *work)
+/* Parse "<freq>" for all CPUs, or a list of "<cpu:freq>" */
+static int parse_freqs(char *str, unsigned int *freq)
 {
-	struct cpu_sync *s = container_of(work, struct cpu_sync,
-						boost_rem.work);
+	unsigned int cpu, val;
+	char *tok;
+	int n = 0;
 
-	pr_debug("Removing boost for CPU%d\n", s->cpu);
-	s->boost_min = 0;
-	/* Force policy re-evaluation to trigger adjust notifier. */
-	cpufreq_update_policy(s->cpu);
-}
+	memset(freq, 0, sizeof(unsigned int) * NR_CPUS);
 
-static void update_policy_online(void)
-{
-	unsigned int i;
+	while ((tok = strsep(&str, " \t\n"))) {
+		if (!*tok)
+			continue;
 
-	/* Re-evaluate policy to trigger adjust notifier for online CPUs */
-	get_online_cpus();
-	for_each_online_cpu(i) {
-		pr_debug("Updating policy for CPU%d\n", i);
-		cpufreq_update_policy(i);
+		if (sscanf(tok, "%u:%u", &cpu, &val) == 2) {
+			if (cpu >= nr_cpu_ids)
+				return -EINVAL;
+			freq[cpu] = val;
+		} else if (!kstrtouint(tok, 10, &val)) {
+			for_each_possible_cpu(cpu)
+				freq[cpu] = val;
+		} else {
+			return -EINVAL;
+		}
+		n++;
 	}
-	put_online_cpus();
+
+	return n ? 0 : -EINVAL;
 }
 
-static void do_input_boost_rem(struct work_struct *work)
+static bool profile_has_floor(struct boost_profile *p)
 {
-	unsigned int i, ret;
-	struct cpu_sync *i_sync_info;
-
-	/* Reset the input_boost_min for all CPUs in the system */
-	pr_debug("Resetting input boost min for all CPUs\n");
-	for_each_possible_cpu(i) {
-		i_sync_info = &per_cpu(sync_info, i);
-		i_sync_info->input_boost_min = 0;
-	}
+	int cpu;
 
-	/* Update policies for all online CPUs */
-	update_policy_online();
+	for_each_possible_cpu(cpu)
+		if (p->freq[cpu])
+			return true;
 
-	if (sched_boost_active) {
-		ret = sched_set_boost(0);
-		if (ret)
-			pr_err("cpu-boost: HMP boost disable failed\n");
-		sched_boost_active = false;
-	}
+	return false;
 }
 
-static int boost_mig_sync_thread(void *data)
+/* Install new floors for @p; takes effect at once if @p is active */
+static void set_profile_freqs(struct boost_profile *p, unsigned int *freq)
 {
-	int dest_cpu = (long) data;
-	int src_cpu, ret;
-	struct cpu_sync *s = &per_cpu(sync_info, dest_cpu);
-	struct cpufreq_policy dest_policy;
-	struct cpufreq_policy src_policy;
-	unsigned long flags;
-	unsigned int req_freq;
-
-	while (1) {
-		wait_event_interruptible(s->sync_wq,
-					s->pending || kthread_should_stop());
-
-		if (kthread_should_stop())
-			break;
-
-		spin_lock_irqsave(&s->lock, flags);
-		s->pending = false;
-		src_cpu = s->src_cpu;
-		spin_unlock_irqrestore(&s->lock, flags);
-
-		ret = cpufreq_get_policy(&src_policy, src_cpu);
-		if (ret)
-			continue;
+	memcpy(p->freq, freq, sizeof(p->freq));
 
-		ret = cpufreq_get_policy(&dest_policy, dest_cpu);
-		if (ret)
-			continue;
+	if (p == input_profile)
+		input_boost_enabled = profile_has_floor(p);
+	if (profile_active(p))
+		boost_update();
+}
 
-		req_freq = load_based_syncs ?
-			(dest_policy.cpuinfo.max_freq * s->task_load) / 100 :
-							src_policy.cur;
+static int boost_define(char *args)
+{
+	char *name = strsep(&args, " \t");
+	char *duration = strsep(&args, " \t");
+	char *boost = strsep(&args, " \t");
+	unsigned int duration_ms, sched_boost, *freq;
+	struct boost_profile *p;
+	int ret;
+
+	if (!name || !*name || strlen(name) >= BOOST_NAME_LEN || !args)
+		return -EINVAL;
 
-		if (req_freq <= dest_policy.cpuinfo.min_freq) {
-			pr_debug("No sync. Sync Freq:%u\n", req_freq);
-			continue;
-		}
+	if (kstrtouint(duration, 10, &duration_ms) ||
+	    kstrtouint(boost, 10, &sched_boost))
+		return -EINVAL;
 
-		if (sync_threshold)
-			req_freq = min(sync_threshold, req_freq);
-
-		cancel_delayed_work_sync(&s->boost_rem);
-
-		s->boost_min = req_freq;
-
-		/* Force policy re-evaluation to trigger adjust notifier. */
-		get_online_cpus();
-		if (cpu_online(src_cpu))
-			/*
-			 * Send an unchanged policy update to the source
-			 * CPU. Even though the policy isn't changed from
-			 * its existing boosted or non-boosted state
-			 * notifying the source CPU will let the governor
-			 * know a boost happened on another CPU and that it
-			 * should re-evaluate the frequency at the next timer
-			 * event without interference from a min sample time.
-			 */
-			cpufreq_update_policy(src_cpu);
-		if (cpu_online(dest_cpu)) {
-			cpufreq_update_policy(dest_cpu);
-			queue_delayed_work_on(dest_cpu, cpu_boost_wq,
-				&s->boost_rem, msecs_to_jiffies(boost_ms));
-		} else {
-			s->boost_min = 0;
+	freq = kcalloc(NR_CPUS, sizeof(*freq), GFP_KERNEL);
+	if (!freq)
+		return -ENOMEM;
+
+	ret = parse_freqs(args, freq);
+	if (ret)
+		goto out;
+
+	p = find_profile(name);
+	if (!p) {
+		if (nr_profiles == MAX_BOOST_PROFILES) {
+			ret = -ENOSPC;
+			goto out;
 		}
-		put_online_cpus();
+		p = &profiles[nr_profiles++];
+		strlcpy(p->name, name, BOOST_NAME_LEN);
 	}
 
-	return 0;
+	p->duration_ms = duration_ms;
+	p->sched_boost = !!sched_boost;
+	set_profile_freqs(p, freq);
+out:
+	kfree(freq);
+	return ret;
 }
 
-static int boost_migration_notify(struct notifier_block *nb,
-				unsigned long unused, void *arg)
+static int set_boost(const char *buf, const struct kernel_param *kp)
 {
-	struct migration_notify_data *mnd = arg;
-	unsigned long flags;
-	struct cpu_sync *s = &per_cpu(sync_info, mnd->dest_cpu);
+	char *str, *args, *cmd, *name;
+	struct boost_profile *p;
+	unsigned int duration_ms;
+	int ret = -EINVAL;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	args = strim(str);
+	cmd = strsep(&args, " \t");
 
-	if (load_based_syncs && (mnd->load <= migration_load_threshold))
-		return NOTIFY_OK;
+	mutex_lock(&boost_lock);
 
-	if (load_based_syncs && ((mnd->load < 0) || (mnd->load > 100))) {
-		pr_err("cpu-boost:Invalid load: %d\n", mnd->load);
-		return NOTIFY_OK;
+	if (!strcmp(cmd, "define")) {
+		ret = boost_define(args);
+		goto out;
 	}
 
-	if (!load_based_syncs && (mnd->src_cpu == mnd->dest_cpu))
-		return NOTIFY_OK;
+	name = strsep(&args, " \t");
+	p = name ? find_profile(name) : NULL;
+	if (!p)
+		goto out;
 
-	if (!boost_ms)
-		return NOTIFY_OK;
+	if (!strcmp(cmd, "start")) {
+		if (!cpu_boost_wq) {
+			ret = -EBUSY;
+			goto out;
+		}
+		duration_ms = p->duration_ms;
+		if (args && kstrtouint(args, 10, &duration_ms))
+			goto out;
+		boost_start(p, duration_ms);
+		ret = 0;
+	} else if (!strcmp(cmd, "stop")) {
+		ret = boost_stop(p);
+	}
+out:
+	mutex_unlock(&boost_lock);
+	kfree(str);
+	return ret;
+}
+
+static int get_boost(char *buf, const struct kernel_param *kp)
+{
+	struct boost_profile *p;
+	u64 residency_us;
+	int cnt = 0, cpu, i;
 
-	/* Avoid deadlock in try_to_wake_up() */
-	if (s->thread == current)
-		return NOTIFY_OK;
+	mutex_lock(&boost_lock);
+	for (i = 0; i < nr_profiles; i++) {
+		p = &profiles[i];
+		residency_us = p->residency_us;
+		if (profile_active(p))
+			residency_us += ktime_to_us(ktime_get()) - p->start_us;
 
-	pr_debug("Migration: CPU%d --> CPU%d\n", mnd->src_cpu, mnd->dest_cpu);
-	spin_lock_irqsave(&s->lock, flags);
-	s->pending = true;
-	s->src_cpu = mnd->src_cpu;
-	s->task_load = load_based_syncs ? mnd->load : 0;
-	spin_unlock_irqrestore(&s->lock, flags);
-	wake_up(&s->sync_wq);
+		cnt += snprintf(buf + cnt, PAGE_SIZE - cnt,
+				"%s: active=%d holds=%d duration_ms=%u sched_boost=%d boosts=%lu residency_ms=%llu freq=",
+				p->name, profile_active(p), p->holds,
+				p->duration_ms, p->sched_boost, p->nr_boosts,
+				div_u64(residency_us, USEC_PER_MSEC));
+		for_each_possible_cpu(cpu)
+			cnt += snprintf(buf + cnt, PAGE_SIZE - cnt, "%d:%u ",
+					cpu, p->freq[cpu]);
+		cnt += snprintf(buf + cnt, PAGE_SIZE - cnt, "\n");
+	}
+	mutex_unlock(&boost_lock);
 
-	return NOTIFY_OK;
+	return cnt;
 }
 
-static struct notifier_block boost_migration_nb = {
-	.notifier_call = boost_migration_notify,
+static const struct kernel_param_ops param_ops_boost = {
+	.set = set_boost,
+	.get = get_boost,
 };
+module_param_cb(boost, &param_ops_boost, NULL, 0644);
 
-static void do_input_boost(struct work_struct *work)
+static int set_input_boost_freq(const char *buf, const struct kernel_param *kp)
 {
-	unsigned int i, ret;
-	struct cpu_sync *i_sync_info;
-
-	cancel_delayed_work_sync(&input_boost_rem);
-	if (sched_boost_active) {
-		sched_set_boost(0);
-		sched_boost_active = false;
+	unsigned int *freq;
+	char *str;
+	int ret;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	freq = kcalloc(NR_CPUS, sizeof(*freq), GFP_KERNEL);
+	if (!str || !freq) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	/* Set the input_boost_min for all CPUs in the system */
-	pr_debug("Setting input boost min for all CPUs\n");
-	for_each_possible_cpu(i) {
-		i_sync_info = &per_cpu(sync_info, i);
-		i_sync_info->input_boost_min = i_sync_info->input_boost_freq;
-	}
+	ret = parse_freqs(str, freq);
+	if (ret)
+		goto out;
+
+	mutex_lock(&boost_lock);
+	set_profile_freqs(input_profile, freq);
+	mutex_unlock(&boost_lock);
+out:
+	kfree(freq);
+	kfree(str);
+	return ret;
+}
 
-	/* Update policies for all online CPUs */
-	update_policy_online();
+static int get_input_boost_freq(char *buf, const struct kernel_param *kp)
+{
+	int cnt = 0, cpu;
 
-	/* Enable scheduler boost to migrate tasks to big cluster */
-	if (sched_boost_on_input) {
-		ret = sched_set_boost(1);
-		if (ret)
-			pr_err("cpu-boost: HMP boost enable failed\n");
-		else
-			sched_boost_active = true;
-	}
+	for_each_possible_cpu(cpu)
+		cnt += snprintf(buf + cnt, PAGE_SIZE - cnt,
+				"%d:%u ", cpu, input_profile->freq[cpu]);
+	cnt += snprintf(buf + cnt, PAGE_SIZE - cnt, "\n");
+	return cnt;
+}
 
-	queue_delayed_work(cpu_boost_wq, &input_boost_rem,
-					msecs_to_jiffies(input_boost_ms));
+static const struct kernel_param_ops param_ops_input_boost_freq = {
+	.set = set_input_boost_freq,
+	.get = get_input_boost_freq,
+};
+module_param_cb(input_boost_freq, &param_ops_input_boost_freq, NULL, 0644);
+
+static void do_input_boost(struct work_struct *work)
+{
+	mutex_lock(&boost_lock);
+	boost_start(input_profile, input_profile->duration_ms);
+	mutex_unlock(&boost_lock);
 }
 
 static void cpuboost_input_event(struct input_handle *handle,
@@ -386,7 +447,7 @@ static void cpuboost_input_event(struct input_handle *handle,
 {
 	u64 now;
 
-	if (!input_boost_enabled)
+	if (!input_boost_enabled || !input_profile->duration_ms)
 		return;
 
 	now = ktime_to_us(ktime_get());
@@ -473,30 +534,17 @@ static struct input_handler cpuboost_input_handler = {
 
 static int cpu_boost_init(void)
 {
-	int cpu, ret;
-	struct cpu_sync *s;
+	int i;
 
 	cpu_boost_wq = alloc_workqueue("cpuboost_wq", WQ_HIGHPRI, 0);
 	if (!cpu_boost_wq)
 		return -EFAULT;
 
-	INIT_WORK(&input_boost_work, do_input_boost);
-	INIT_DELAYED_WORK(&input_boost_rem, do_input_boost_rem);
+	for (i = 0; i < MAX_BOOST_PROFILES; i++)
+		INIT_DELAYED_WORK(&profiles[i].expire, do_boost_expire);
 
-	for_each_possible_cpu(cpu) {
-		s = &per_cpu(sync_info, cpu);
-		s->cpu = cpu;
-		init_waitqueue_head(&s->sync_wq);
-		spin_lock_init(&s->lock);
-		INIT_DELAYED_WORK(&s->boost_rem, do_boost_rem);
-		s->thread = kthread_run(boost_mig_sync_thread,
-				(void *) (long)cpu, "boost_sync/%d", cpu);
-		set_cpus_allowed(s->thread, *cpumask_of(cpu));
-	}
-	cpufreq_register_notifier(&boost_adjust_nb, CPUFREQ_POLICY_NOTIFIER);
-	atomic_notifier_chain_register(&migration_notifier_head,
-					&boost_migration_nb);
-	ret = input_register_handler(&cpuboost_input_handler);
+	INIT_WORK(&input_boost_work, do_input_boost);
+	input_register_handler(&cpuboost_input_handler);
 
 	return 0;
 }
@@ -1827,6 +1827,41 @@ int cpufreq_driver_target(struct cpufreq_policy *policy,
 }
 EXPORT_SYMBOL_GPL(cpufreq_driver_target);
 
+bool cpufreq_driver_fast_switch_possible(void)
+{
+	return cpufreq_driver && cpufreq_driver->fast_switch;
+}
+EXPORT_SYMBOL_GPL(cpufreq_driver_fast_switch_possible);
+
+/**
+ * cpufreq_driver_fast_switch - switch frequency from atomic context
+ * @policy: policy to switch
+ * @target_freq: wanted frequency, clamped to the policy limits
+ *
+ * Only valid if cpufreq_driver_fast_switch_possible(). Transition
+ * notifiers may sleep and are not called, so the caller is responsible
+ * for telling whoever needs to know about the new frequency.
+ *
+ * Returns the frequency set, or 0 if the switch failed.
+ */
+unsigned int cpufreq_driver_fast_switch(struct cpufreq_policy *policy,
+					unsigned int target_freq)
+{
+	unsigned int freq;
+
+	if (target_freq > policy->max)
+		target_freq = policy->max;
+	if (target_freq < policy->min)
+		target_freq = policy->min;
+
+	freq = cpufreq_driver->fast_switch(policy, target_freq);
+	if (freq)
+		policy->cur = freq;
+
+	return freq;
+}
+EXPORT_SYMBOL_GPL(cpufreq_driver_fast_switch);
+
 /*
  * when "event" is CPUFREQ_GOV_LIMITS
  */
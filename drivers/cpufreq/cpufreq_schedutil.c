@@ -0,0 +1,510 @@
+/*
+ * drivers/cpufreq/cpufreq_schedutil.c
+ *
+ * cpufreq governor driven by the scheduler's window-based busy time
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cpu.h>
+#include <linux/cpufreq.h>
+#include <linux/cpumask.h>
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/rt.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#define DEFAULT_RATE_LIMIT_US	1000
+
+struct sugov_tunables {
+	/* minimum time between two frequency changes */
+	unsigned int rate_limit_us;
+	int usage_count;
+};
+
+struct sugov_policy {
+	struct cpufreq_policy *policy;
+	struct sugov_tunables *tunables;
+
+	raw_spinlock_t update_lock;	/* for the fields below */
+	u64 last_freq_update_time;
+	unsigned int next_freq;
+	bool work_in_progress;
+	bool need_freq_update;
+
+	/*
+	 * The scheduler calls in with its rq->lock held, so the switch
+	 * itself is deferred to an irq_work: it switches right there when
+	 * the driver supports it, or else hands over to a SCHED_FIFO
+	 * kthread.
+	 */
+	struct irq_work irq_work;
+	struct kthread_work work;
+	struct kthread_worker worker;
+	struct task_struct *thread;
+	struct mutex work_lock;
+};
+
+struct sugov_cpu {
+	struct update_util_data update_util;
+	struct sugov_policy *sg_policy;
+	int cpu;
+
+	/* load in the last window, as of last_update */
+	unsigned long util;
+	unsigned long max;
+	u64 last_update;
+};
+
+static DEFINE_PER_CPU(struct sugov_cpu, sugov_cpu);
+static struct sugov_tunables *common_tunables;
+static DEFINE_MUTEX(gov_lock);
+
+static bool sugov_should_update_freq(struct sugov_policy *sg_policy, u64 time)
+{
+	s64 delta_ns;
+
+	if (sg_policy->work_in_progress)
+		return false;
+
+	if (unlikely(sg_policy->need_freq_update)) {
+		sg_policy->need_freq_update = false;
+		return true;
+	}
+
+	delta_ns = time - sg_policy->last_freq_update_time;
+	return delta_ns >= (s64)sg_policy->tunables->rate_limit_us *
+			   NSEC_PER_USEC;
+}
+
+/*
+ * Pick the frequency that would have run the last window's load at 80%
+ * busy: the scheduler scales busy time to the max possible frequency, so
+ * the frequency the load needs is proportional to util / max.
+ */
+static unsigned int sugov_next_freq(struct sugov_policy *sg_policy,
+				    unsigned long util, unsigned long max)
+{
+	struct cpufreq_policy *policy = sg_policy->policy;
+	unsigned int freq = policy->cpuinfo.max_freq;
+	u64 next_f;
+
+	next_f = div_u64((u64)(freq + (freq >> 2)) * util, max);
+
+	return clamp_t(u64, next_f, policy->min, policy->max);
+}
+
+/* A frequency domain has to run as fast as its busiest CPU needs */
+static unsigned int sugov_next_freq_shared(struct sugov_cpu *sg_cpu, u64 time)
+{
+	struct sugov_policy *sg_policy = sg_cpu->sg_policy;
+	unsigned long util = 0, max = 1;
+	unsigned int j;
+
+	for_each_cpu(j, sg_policy->policy->cpus) {
+		struct sugov_cpu *j_sg_cpu = &per_cpu(sugov_cpu, j);
+		unsigned long j_util = j_sg_cpu->util;
+		unsigned long j_max = j_sg_cpu->max;
+
+		/*
+		 * Windows roll over only when something happens on a CPU,
+		 * so one that has been quiet for a window is idle and its
+		 * last load is stale.
+		 */
+		if (j_sg_cpu != sg_cpu &&
+		    (s64)(time - j_sg_cpu->last_update) > (s64)j_max)
+			continue;
+
+		if (j_util * max > j_max * util) {
+			util = j_util;
+			max = j_max;
+		}
+	}
+
+	return sugov_next_freq(sg_policy, util, max);
+}
+
+static void sugov_update(struct update_util_data *hook, u64 time,
+			 unsigned int flags)
+{
+	struct sugov_cpu *sg_cpu = container_of(hook, struct sugov_cpu,
+						update_util);
+	struct sugov_policy *sg_policy = sg_cpu->sg_policy;
+	unsigned int next_f;
+
+	sched_get_cpu_util(sg_cpu->cpu, &sg_cpu->util, &sg_cpu->max);
+	sg_cpu->last_update = time;
+
+	raw_spin_lock(&sg_policy->update_lock);
+
+	if (!sugov_should_update_freq(sg_policy, time))
+		goto unlock;
+
+	next_f = sugov_next_freq_shared(sg_cpu, time);
+	if (next_f == sg_policy->next_freq &&
+	    next_f == sg_policy->policy->cur)
+		goto unlock;
+
+	sg_policy->next_freq = next_f;
+	sg_policy->last_freq_update_time = time;
+	sg_policy->work_in_progress = true;
+	irq_work_queue(&sg_policy->irq_work);
+
+unlock:
+	raw_spin_unlock(&sg_policy->update_lock);
+}
+
+static void sugov_work(struct kthread_work *work)
+{
+	struct sugov_policy *sg_policy = container_of(work, struct sugov_policy,
+						      work);
+
+	mutex_lock(&sg_policy->work_lock);
+	__cpufreq_driver_target(sg_policy->policy, sg_policy->next_freq,
+				CPUFREQ_RELATION_L);
+	mutex_unlock(&sg_policy->work_lock);
+
+	sg_policy->work_in_progress = false;
+}
+
+static void sugov_irq_work(struct irq_work *irq_work)
+{
+	struct sugov_policy *sg_policy = container_of(irq_work,
+					struct sugov_policy, irq_work);
+	struct cpufreq_policy *policy = sg_policy->policy;
+	unsigned int freq;
+
+	if (!cpufreq_driver_fast_switch_possible()) {
+		queue_kthread_work(&sg_policy->worker, &sg_policy->work);
+		return;
+	}
+
+	freq = cpufreq_driver_fast_switch(policy, sg_policy->next_freq);
+	if (freq)
+		sched_update_cur_freq(policy->cpu, freq);
+
+	sg_policy->work_in_progress = false;
+}
+
+/************************** sysfs interface ************************/
+
+static ssize_t show_rate_limit_us(struct sugov_tunables *tunables, char *buf)
+{
+	return sprintf(buf, "%u\n", tunables->rate_limit_us);
+}
+
+static ssize_t store_rate_limit_us(struct sugov_tunables *tunables,
+				   const char *buf, size_t count)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	tunables->rate_limit_us = val;
+	return count;
+}
+
+static ssize_t show_rate_limit_us_gov_sys(struct kobject *kobj,
+					  struct attribute *attr, char *buf)
+{
+	return show_rate_limit_us(common_tunables, buf);
+}
+
+static ssize_t store_rate_limit_us_gov_sys(struct kobject *kobj,
+		struct attribute *attr, const char *buf, size_t count)
+{
+	return store_rate_limit_us(common_tunables, buf, count);
+}
+
+static ssize_t show_rate_limit_us_gov_pol(struct cpufreq_policy *policy,
+					  char *buf)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+
+	return show_rate_limit_us(sg_policy->tunables, buf);
+}
+
+static ssize_t store_rate_limit_us_gov_pol(struct cpufreq_policy *policy,
+					   const char *buf, size_t count)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+
+	return store_rate_limit_us(sg_policy->tunables, buf, count);
+}
+
+static struct global_attr rate_limit_us_gov_sys =
+__ATTR(rate_limit_us, 0644, show_rate_limit_us_gov_sys,
+	store_rate_limit_us_gov_sys);
+
+static struct freq_attr rate_limit_us_gov_pol =
+__ATTR(rate_limit_us, 0644, show_rate_limit_us_gov_pol,
+	store_rate_limit_us_gov_pol);
+
+/* One Governor instance for entire system */
+static struct attribute *sugov_attributes_gov_sys[] = {
+	&rate_limit_us_gov_sys.attr,
+	NULL,
+};
+
+static struct attribute_group sugov_attr_group_gov_sys = {
+	.attrs = sugov_attributes_gov_sys,
+	.name = "schedutil",
+};
+
+/* Per policy governor instance */
+static struct attribute *sugov_attributes_gov_pol[] = {
+	&rate_limit_us_gov_pol.attr,
+	NULL,
+};
+
+static struct attribute_group sugov_attr_group_gov_pol = {
+	.attrs = sugov_attributes_gov_pol,
+	.name = "schedutil",
+};
+
+static struct attribute_group *get_sysfs_attr(void)
+{
+	if (have_governor_per_policy())
+		return &sugov_attr_group_gov_pol;
+	else
+		return &sugov_attr_group_gov_sys;
+}
+
+/********************** cpufreq governor interface *********************/
+
+static struct sugov_policy *sugov_policy_alloc(struct cpufreq_policy *policy)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	struct sugov_policy *sg_policy;
+
+	sg_policy = kzalloc(sizeof(*sg_policy), GFP_KERNEL);
+	if (!sg_policy)
+		return ERR_PTR(-ENOMEM);
+
+	sg_policy->policy = policy;
+	raw_spin_lock_init(&sg_policy->update_lock);
+	mutex_init(&sg_policy->work_lock);
+	init_irq_work(&sg_policy->irq_work, sugov_irq_work);
+	init_kthread_work(&sg_policy->work, sugov_work);
+	init_kthread_worker(&sg_policy->worker);
+
+	sg_policy->thread = kthread_create(kthread_worker_fn,
+					   &sg_policy->worker,
+					   "sugov:%d", policy->cpu);
+	if (IS_ERR(sg_policy->thread)) {
+		int err = PTR_ERR(sg_policy->thread);
+
+		pr_err("failed to create sugov thread: %d\n", err);
+		kfree(sg_policy);
+		return ERR_PTR(err);
+	}
+
+	sched_setscheduler_nocheck(sg_policy->thread, SCHED_FIFO, &param);
+	wake_up_process(sg_policy->thread);
+
+	return sg_policy;
+}
+
+static void sugov_policy_free(struct sugov_policy *sg_policy)
+{
+	flush_kthread_worker(&sg_policy->worker);
+	kthread_stop(sg_policy->thread);
+	mutex_destroy(&sg_policy->work_lock);
+	kfree(sg_policy);
+}
+
+static int sugov_init(struct cpufreq_policy *policy)
+{
+	struct sugov_policy *sg_policy;
+	struct sugov_tunables *tunables;
+	int rc;
+
+	sg_policy = sugov_policy_alloc(policy);
+	if (IS_ERR(sg_policy))
+		return PTR_ERR(sg_policy);
+
+	mutex_lock(&gov_lock);
+
+	if (!have_governor_per_policy() && common_tunables) {
+		common_tunables->usage_count++;
+		sg_policy->tunables = common_tunables;
+		policy->governor_data = sg_policy;
+		mutex_unlock(&gov_lock);
+		return 0;
+	}
+
+	tunables = kzalloc(sizeof(*tunables), GFP_KERNEL);
+	if (!tunables) {
+		rc = -ENOMEM;
+		goto free_policy;
+	}
+
+	tunables->rate_limit_us = DEFAULT_RATE_LIMIT_US;
+	tunables->usage_count = 1;
+	sg_policy->tunables = tunables;
+	policy->governor_data = sg_policy;
+
+	if (!have_governor_per_policy()) {
+		WARN_ON(cpufreq_get_global_kobject());
+		common_tunables = tunables;
+	}
+
+	rc = sysfs_create_group(get_governor_parent_kobj(policy),
+				get_sysfs_attr());
+	if (rc) {
+		if (!have_governor_per_policy()) {
+			common_tunables = NULL;
+			cpufreq_put_global_kobject();
+		}
+		policy->governor_data = NULL;
+		kfree(tunables);
+		goto free_policy;
+	}
+
+	mutex_unlock(&gov_lock);
+	return 0;
+
+free_policy:
+	mutex_unlock(&gov_lock);
+	sugov_policy_free(sg_policy);
+	return rc;
+}
+
+static void sugov_exit(struct cpufreq_policy *policy)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+	struct sugov_tunables *tunables = sg_policy->tunables;
+
+	mutex_lock(&gov_lock);
+
+	if (!--tunables->usage_count) {
+		sysfs_remove_group(get_governor_parent_kobj(policy),
+				   get_sysfs_attr());
+		if (!have_governor_per_policy()) {
+			cpufreq_put_global_kobject();
+			common_tunables = NULL;
+		}
+		kfree(tunables);
+	}
+
+	policy->governor_data = NULL;
+	mutex_unlock(&gov_lock);
+
+	sugov_policy_free(sg_policy);
+}
+
+static void sugov_start(struct cpufreq_policy *policy)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+	unsigned int cpu;
+
+	sg_policy->last_freq_update_time = 0;
+	sg_policy->next_freq = UINT_MAX;
+	sg_policy->work_in_progress = false;
+	sg_policy->need_freq_update = false;
+
+	for_each_cpu(cpu, policy->cpus) {
+		struct sugov_cpu *sg_cpu = &per_cpu(sugov_cpu, cpu);
+
+		memset(sg_cpu, 0, sizeof(*sg_cpu));
+		sg_cpu->sg_policy = sg_policy;
+		sg_cpu->cpu = cpu;
+		sg_cpu->max = 1;
+		cpufreq_add_update_util_hook(cpu, &sg_cpu->update_util,
+					     sugov_update);
+	}
+}
+
+static void sugov_stop(struct cpufreq_policy *policy)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+	unsigned int cpu;
+
+	for_each_cpu(cpu, policy->cpus)
+		cpufreq_remove_update_util_hook(cpu);
+
+	synchronize_sched();
+
+	irq_work_sync(&sg_policy->irq_work);
+	flush_kthread_work(&sg_policy->work);
+}
+
+static void sugov_limits(struct cpufreq_policy *policy)
+{
+	struct sugov_policy *sg_policy = policy->governor_data;
+	unsigned long flags;
+
+	mutex_lock(&sg_policy->work_lock);
+	if (policy->max < policy->cur)
+		__cpufreq_driver_target(policy, policy->max,
+					CPUFREQ_RELATION_H);
+	else if (policy->min > policy->cur)
+		__cpufreq_driver_target(policy, policy->min,
+					CPUFREQ_RELATION_L);
+	mutex_unlock(&sg_policy->work_lock);
+
+	raw_spin_lock_irqsave(&sg_policy->update_lock, flags);
+	sg_policy->need_freq_update = true;
+	raw_spin_unlock_irqrestore(&sg_policy->update_lock, flags);
+}
+
+static int cpufreq_governor_schedutil(struct cpufreq_policy *policy,
+				      unsigned int event)
+{
+	switch (event) {
+	case CPUFREQ_GOV_POLICY_INIT:
+		return sugov_init(policy);
+
+	case CPUFREQ_GOV_POLICY_EXIT:
+		sugov_exit(policy);
+		break;
+
+	case CPUFREQ_GOV_START:
+		sugov_start(policy);
+		break;
+
+	case CPUFREQ_GOV_STOP:
+		sugov_stop(policy);
+		break;
+
+	case CPUFREQ_GOV_LIMITS:
+		sugov_limits(policy);
+		break;
+	}
+
+	return 0;
+}
+
+static struct cpufreq_governor cpufreq_gov_schedutil = {
+	.name = "schedutil",
+	.governor = cpufreq_governor_schedutil,
+	.max_transition_latency = 10000000,
+	.owner = THIS_MODULE,
+};
+
+static int __init cpufreq_schedutil_init(void)
+{
+	return cpufreq_register_governor(&cpufreq_gov_schedutil);
+}
+module_init(cpufreq_schedutil_init);
+
+MODULE_DESCRIPTION("'cpufreq_schedutil' - A cpufreq governor driven by "
+	"scheduler window-based load");
+MODULE_LICENSE("GPL");
@@ -20,9 +20,12 @@
 #include <linux/freezer.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
 #include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/list_sort.h>
+#include <linux/math64.h>
 #include <linux/memblock.h>
 #include <linux/miscdevice.h>
 #include <linux/export.h>
@@ -44,19 +47,32 @@
 #include "ion_priv.h"
 #include "compat_ion.h"
 
+#define ION_BUFFER_INDEX_BITS	6
+#define ION_HANDLE_HASH_BITS	5
+
+/**
+ * struct ion_buffer_bucket - one chain of the device's buffer index
+ * @lock:		serializes changes to the chain, walkers use RCU
+ * @head:		buffers hashing to this chain
+ */
+struct ion_buffer_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
 /**
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
- * @buffers:		an rb tree of all the existing buffers
- * @buffer_lock:	lock protecting the tree of buffers
+ * @buffers:		hashed index of all the existing buffers, so that
+ *			buffers created and destroyed on different cpus
+ *			don't serialize on a single lock
  * @lock:		rwsem protecting the tree of heaps and clients
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
  */
 struct ion_device {
 	struct miscdevice dev;
-	struct rb_root buffers;
-	struct mutex buffer_lock;
+	struct ion_buffer_bucket buffers[1 << ION_BUFFER_INDEX_BITS];
 	struct rw_semaphore lock;
 	struct plist_head heaps;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
@@ -71,22 +87,24 @@ struct ion_device {
  * struct ion_client - a process/hw block local address space
  * @node:		node in the tree of all clients
  * @dev:		backpointer to ion device
- * @handles:		an rb tree of all the handles in this client
+ * @handles:		hash table of all the handles in this client, keyed
+ *			by buffer
  * @idr:		an idr space for allocating handle ids
- * @lock:		lock protecting the tree of handles
+ * @lock:		lock protecting the table of handles
  * @name:		used for debugging
  * @display_name:	used for debugging (unique version of @name)
  * @display_serial:	used for debugging (to make display_name unique)
  * @task:		used for debugging
  *
  * A client represents a list of buffers this client may access.
- * The mutex stored here is used to protect both handles tree
+ * The mutex stored here is used to protect both handles table
  * as well as the handles themselves, and should be held while modifying either.
+ * Looking a handle up by id only needs RCU.
  */
 struct ion_client {
 	struct rb_node node;
 	struct ion_device *dev;
-	struct rb_root handles;
+	DECLARE_HASHTABLE(handles, ION_HANDLE_HASH_BITS);
 	struct idr idr;
 	struct mutex lock;
 	char *name;
@@ -102,9 +120,10 @@ struct ion_client {
  * @ref:		reference count
  * @client:		back pointer to the client the buffer resides in
  * @buffer:		pointer to the buffer
- * @node:		node in the client's handle rbtree
+ * @node:		node in the client's handle table
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @id:			client-unique id allocated by client->idr
+ * @rcu:		used to free the handle after lockless lookups
  *
  * Modifications to node, map_cnt or mapping should be protected by the
  * lock in the client.  Other fields are never changed after initialization.
@@ -113,9 +132,10 @@ struct ion_handle {
 	struct kref ref;
 	struct ion_client *client;
 	struct ion_buffer *buffer;
-	struct rb_node node;
+	struct hlist_node node;
 	unsigned int kmap_cnt;
 	int id;
+	struct rcu_head rcu;
 };
 
 static struct ion_device *ion_dev;
@@ -151,30 +171,30 @@ static inline void ion_buffer_page_clean(struct page **page)
 	*page = (struct page *)((unsigned long)(*page) & ~(1UL));
 }
 
-/* this function should only be called while dev->lock is held */
+static struct ion_buffer_bucket *ion_buffer_bucket(struct ion_device *dev,
+						   struct ion_buffer *buffer)
+{
+	return &dev->buffers[hash_ptr(buffer, ION_BUFFER_INDEX_BITS)];
+}
+
 static void ion_buffer_add(struct ion_device *dev,
 			   struct ion_buffer *buffer)
 {
-	struct rb_node **p = &dev->buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct ion_buffer *entry;
+	struct ion_buffer_bucket *bucket = ion_buffer_bucket(dev, buffer);
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct ion_buffer, node);
+	spin_lock(&bucket->lock);
+	hlist_add_head_rcu(&buffer->index_node, &bucket->head);
+	spin_unlock(&bucket->lock);
+}
 
-		if (buffer < entry) {
-			p = &(*p)->rb_left;
-		} else if (buffer > entry) {
-			p = &(*p)->rb_right;
-		} else {
-			pr_err("%s: buffer already found.", __func__);
-			BUG();
-		}
-	}
+static void ion_buffer_remove(struct ion_device *dev,
+			      struct ion_buffer *buffer)
+{
+	struct ion_buffer_bucket *bucket = ion_buffer_bucket(dev, buffer);
 
-	rb_link_node(&buffer->node, parent, p);
-	rb_insert_color(&buffer->node, &dev->buffers);
+	spin_lock(&bucket->lock);
+	hlist_del_rcu(&buffer->index_node);
+	spin_unlock(&bucket->lock);
 }
 
 /* this function should only be called while dev->lock is held */
@@ -257,9 +277,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 		if (sg_dma_address(sg) == 0)
 			sg_dma_address(sg) = sg_phys(sg);
 	}
-	mutex_lock(&dev->buffer_lock);
 	ion_buffer_add(dev, buffer);
-	mutex_unlock(&dev->buffer_lock);
 	atomic_add(len, &heap->total_allocated);
 	return buffer;
 
@@ -282,7 +300,7 @@ void ion_buffer_destroy(struct ion_buffer *buffer)
 	buffer->heap->ops->free(buffer);
 	if (buffer->pages)
 		vfree(buffer->pages);
-	kfree(buffer);
+	kfree_rcu(buffer, rcu);
 }
 
 static void _ion_buffer_destroy(struct kref *kref)
@@ -291,9 +309,7 @@ static void _ion_buffer_destroy(struct kref *kref)
 	struct ion_heap *heap = buffer->heap;
 	struct ion_device *dev = buffer->dev;
 
-	mutex_lock(&dev->buffer_lock);
-	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->buffer_lock);
+	ion_buffer_remove(dev, buffer);
 
 	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
 		ion_heap_freelist_add(heap, buffer);
@@ -355,7 +371,7 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 	if (!handle)
 		return ERR_PTR(-ENOMEM);
 	kref_init(&handle->ref);
-	RB_CLEAR_NODE(&handle->node);
+	INIT_HLIST_NODE(&handle->node);
 	handle->client = client;
 	ion_buffer_get(buffer);
 	ion_buffer_add_to_handle(buffer);
@@ -378,13 +394,13 @@ static void ion_handle_destroy(struct kref *kref)
 	mutex_unlock(&buffer->lock);
 
 	idr_remove(&client->idr, handle->id);
-	if (!RB_EMPTY_NODE(&handle->node))
-		rb_erase(&handle->node, &client->handles);
+	if (!hlist_unhashed(&handle->node))
+		hash_del(&handle->node);
 
 	ion_buffer_remove_from_handle(buffer);
 	ion_buffer_put(buffer);
 
-	kfree(handle);
+	kfree_rcu(handle, rcu);
 }
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle)
@@ -421,18 +437,13 @@ int ion_handle_put(struct ion_handle *handle)
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
 					    struct ion_buffer *buffer)
 {
-	struct rb_node *n = client->handles.rb_node;
-
-	while (n) {
-		struct ion_handle *entry = rb_entry(n, struct ion_handle, node);
+	struct ion_handle *entry;
 
-		if (buffer < entry->buffer)
-			n = n->rb_left;
-		else if (buffer > entry->buffer)
-			n = n->rb_right;
-		else
+	hash_for_each_possible(client->handles, entry, node,
+			       (unsigned long)buffer)
+		if (entry->buffer == buffer)
 			return entry;
-	}
+
 	return ERR_PTR(-EINVAL);
 }
 
@@ -448,16 +459,22 @@ static struct ion_handle *ion_handle_get_by_id_nolock(struct ion_client *client,
 	return handle ? handle : ERR_PTR(-EINVAL);
 }
 
+/*
+ * Handles are freed after an RCU grace period, so a lookup only has to
+ * make sure it doesn't revive one whose last reference is being dropped.
+ */
 struct ion_handle *ion_handle_get_by_id(struct ion_client *client,
 						int id)
 {
 	struct ion_handle *handle;
 
-	mutex_lock(&client->lock);
-	handle = ion_handle_get_by_id_nolock(client, id);
-	mutex_unlock(&client->lock);
+	rcu_read_lock();
+	handle = idr_find(&client->idr, id);
+	if (handle && !kref_get_unless_zero(&handle->ref))
+		handle = NULL;
+	rcu_read_unlock();
 
-	return handle;
+	return handle ? handle : ERR_PTR(-EINVAL);
 }
 
 static bool ion_handle_validate(struct ion_client *client,
@@ -470,30 +487,17 @@ static bool ion_handle_validate(struct ion_client *client,
 static int ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 {
 	int id;
-	struct rb_node **p = &client->handles.rb_node;
-	struct rb_node *parent = NULL;
-	struct ion_handle *entry;
+
+	WARN(!IS_ERR(ion_handle_lookup(client, handle->buffer)),
+	     "%s: buffer already found.", __func__);
 
 	id = idr_alloc(&client->idr, handle, 1, 0, GFP_KERNEL);
 	if (id < 0)
 		return id;
 
 	handle->id = id;
-
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct ion_handle, node);
-
-		if (handle->buffer < entry->buffer)
-			p = &(*p)->rb_left;
-		else if (handle->buffer > entry->buffer)
-			p = &(*p)->rb_right;
-		else
-			WARN(1, "%s: buffer already found.", __func__);
-	}
-
-	rb_link_node(&handle->node, parent, p);
-	rb_insert_color(&handle->node, &client->handles);
+	hash_add(client->handles, &handle->node,
+		 (unsigned long)handle->buffer);
 
 	return 0;
 }
@@ -768,8 +772,10 @@ EXPORT_SYMBOL(ion_unmap_kernel);
 static int ion_debug_client_show(struct seq_file *s, void *unused)
 {
 	struct ion_client *client = s->private;
-	struct rb_node *n, *cnode;
+	struct ion_handle *handle;
+	struct rb_node *cnode;
 	bool found = false;
+	int bkt;
 
 	down_write(&ion_dev->lock);
 
@@ -798,10 +804,7 @@ static int ion_debug_client_show(struct seq_file *s, void *unused)
 			"buffer");
 
 	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
-
+	hash_for_each(client->handles, bkt, handle, node) {
 		seq_printf(s, "%16.16s: %16zx : %16d : %12p",
 				handle->buffer->heap->name,
 				handle->buffer->size,
@@ -877,7 +880,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 		goto err_put_task_struct;
 
 	client->dev = dev;
-	client->handles = RB_ROOT;
+	hash_init(client->handles);
 	idr_init(&client->idr);
 	mutex_init(&client->lock);
 
@@ -936,15 +939,14 @@ EXPORT_SYMBOL(ion_client_create);
 void ion_client_destroy(struct ion_client *client)
 {
 	struct ion_device *dev = client->dev;
-	struct rb_node *n;
+	struct ion_handle *handle;
+	struct hlist_node *tmp;
+	int bkt;
 
 	pr_debug("%s: %d\n", __func__, __LINE__);
 	mutex_lock(&client->lock);
-	while ((n = rb_first(&client->handles))) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
+	hash_for_each_safe(client->handles, bkt, tmp, handle, node)
 		ion_handle_destroy(&handle->ref);
-	}
 
 	idr_destroy(&client->idr);
 	mutex_unlock(&client->lock);
@@ -1619,13 +1621,11 @@ static size_t ion_debug_heap_total(struct ion_client *client,
 				   unsigned int id)
 {
 	size_t size = 0;
-	struct rb_node *n;
+	struct ion_handle *handle;
+	int bkt;
 
 	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n,
-						     struct ion_handle,
-						     node);
+	hash_for_each(client->handles, bkt, handle, node) {
 		if (handle->buffer->heap->id == id)
 			size += handle->buffer->size;
 	}
@@ -1652,15 +1652,13 @@ void ion_debug_mem_map_create(struct seq_file *s, struct ion_heap *heap,
 
 	down_read(&dev->lock);
 	for (cnode = rb_first(&dev->clients); cnode; cnode = rb_next(cnode)) {
-		struct rb_node *hnode;
+		struct ion_handle *handle;
+		int bkt;
+
 		client = rb_entry(cnode, struct ion_client, node);
 
 		mutex_lock(&client->lock);
-		for (hnode = rb_first(&client->handles);
-		     hnode;
-		     hnode = rb_next(hnode)) {
-			struct ion_handle *handle = rb_entry(
-				hnode, struct ion_handle, node);
+		hash_for_each(client->handles, bkt, handle, node) {
 			if (handle->buffer->heap == heap) {
 				struct mem_map_data *data =
 					kzalloc(sizeof(*data), GFP_KERNEL);
@@ -1737,9 +1735,11 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 {
 	struct ion_heap *heap = s->private;
 	struct ion_device *dev = heap->dev;
+	struct ion_buffer *buffer;
 	struct rb_node *n;
 	size_t total_size = 0;
 	size_t total_orphaned_size = 0;
+	int i;
 
 	seq_printf(s, "%16.s %16.s %16.s\n", "client", "pid", "size");
 	seq_printf(s, "----------------------------------------------------\n");
@@ -1767,29 +1767,43 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	seq_printf(s, "----------------------------------------------------\n");
 	seq_printf(s, "orphaned allocations (info is from last known client):"
 		   "\n");
-	mutex_lock(&dev->buffer_lock);
-	for (n = rb_first(&dev->buffers); n; n = rb_next(n)) {
-		struct ion_buffer *buffer = rb_entry(n, struct ion_buffer,
-						     node);
-		if (buffer->heap->id != heap->id)
-			continue;
-		total_size += buffer->size;
-		if (!buffer->handle_count) {
-			seq_printf(s, "%16.s %16u %16zu %d %d\n",
-				   buffer->task_comm, buffer->pid,
-				   buffer->size, buffer->kmap_cnt,
-				   atomic_read(&buffer->ref.refcount));
-			total_orphaned_size += buffer->size;
+	rcu_read_lock();
+	for (i = 0; i < ARRAY_SIZE(dev->buffers); i++) {
+		hlist_for_each_entry_rcu(buffer, &dev->buffers[i].head,
+					 index_node) {
+			if (buffer->heap->id != heap->id)
+				continue;
+			total_size += buffer->size;
+			if (!buffer->handle_count) {
+				seq_printf(s, "%16.s %16u %16zu %d %d\n",
+					   buffer->task_comm, buffer->pid,
+					   buffer->size, buffer->kmap_cnt,
+					   atomic_read(&buffer->ref.refcount));
+				total_orphaned_size += buffer->size;
+			}
 		}
 	}
-	mutex_unlock(&dev->buffer_lock);
+	rcu_read_unlock();
 	seq_printf(s, "----------------------------------------------------\n");
 	seq_printf(s, "%16.s %16zu\n", "total orphaned",
 		   total_orphaned_size);
 	seq_printf(s, "%16.s %16zu\n", "total ", total_size);
-	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
+		u64 avg_us = 0;
+
+		spin_lock(&heap->free_lock);
 		seq_printf(s, "%16.s %16zu\n", "deferred free",
 				heap->free_list_size);
+		seq_printf(s, "%16.s %16lu\n", "deferred count",
+				heap->free_list_count);
+		if (heap->free_drained)
+			avg_us = div64_u64(heap->free_latency_total_us,
+					   heap->free_drained);
+		seq_printf(s, "%16.s %16llu\n", "avg free us", avg_us);
+		seq_printf(s, "%16.s %16llu\n", "max free us",
+				heap->free_latency_max_us);
+		spin_unlock(&heap->free_lock);
+	}
 	seq_printf(s, "----------------------------------------------------\n");
 
 	if (heap->debug_show)
@@ -1957,7 +1971,7 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 				      unsigned long arg))
 {
 	struct ion_device *idev;
-	int ret;
+	int ret, i;
 
 	idev = kzalloc(sizeof(struct ion_device), GFP_KERNEL);
 	if (!idev)
@@ -1991,8 +2005,10 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 debugfs_done:
 
 	idev->custom_ioctl = custom_ioctl;
-	idev->buffers = RB_ROOT;
-	mutex_init(&idev->buffer_lock);
+	for (i = 0; i < ARRAY_SIZE(idev->buffers); i++) {
+		spin_lock_init(&idev->buffers[i].lock);
+		INIT_HLIST_HEAD(&idev->buffers[i].head);
+	}
 	init_rwsem(&idev->lock);
 	plist_head_init(&idev->heaps);
 	idev->clients = RB_ROOT;
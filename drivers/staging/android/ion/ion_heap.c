@@ -29,6 +29,9 @@
 #include "ion.h"
 #include "ion_priv.h"
 
+/* Upper bound on the buffers the deferred free thread handles at once */
+#define ION_HEAP_FREE_BATCH	SZ_16M
+
 void *ion_heap_map_kernel(struct ion_heap *heap,
 			  struct ion_buffer *buffer)
 {
@@ -155,13 +158,28 @@ end:
 
 void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
 {
+	buffer->free_time = ktime_get();
 	spin_lock(&heap->free_lock);
-	list_add(&buffer->list, &heap->free_list);
+	list_add_tail(&buffer->list, &heap->free_list);
 	heap->free_list_size += buffer->size;
+	heap->free_list_count++;
 	spin_unlock(&heap->free_lock);
 	wake_up(&heap->waitqueue);
 }
 
+/* Account a buffer released by the deferred free path */
+static void ion_heap_free_done(struct ion_heap *heap, ktime_t queued)
+{
+	u64 us = ktime_us_delta(ktime_get(), queued);
+
+	spin_lock(&heap->free_lock);
+	heap->free_drained++;
+	heap->free_latency_total_us += us;
+	if (us > heap->free_latency_max_us)
+		heap->free_latency_max_us = us;
+	spin_unlock(&heap->free_lock);
+}
+
 size_t ion_heap_freelist_size(struct ion_heap *heap)
 {
 	size_t size;
@@ -178,6 +196,7 @@ static size_t _ion_heap_freelist_drain(struct ion_heap *heap, size_t size,
 {
 	struct ion_buffer *buffer;
 	size_t total_drained = 0;
+	ktime_t queued;
 
 	if (ion_heap_freelist_size(heap) == 0)
 		return 0;
@@ -193,11 +212,14 @@ static size_t _ion_heap_freelist_drain(struct ion_heap *heap, size_t size,
 					  list);
 		list_del(&buffer->list);
 		heap->free_list_size -= buffer->size;
+		heap->free_list_count--;
 		if (skip_pools)
 			buffer->private_flags |= ION_PRIV_FLAG_SHRINKER_FREE;
 		total_drained += buffer->size;
+		queued = buffer->free_time;
 		spin_unlock(&heap->free_lock);
 		ion_buffer_destroy(buffer);
+		ion_heap_free_done(heap, queued);
 		spin_lock(&heap->free_lock);
 	}
 	spin_unlock(&heap->free_lock);
@@ -220,22 +242,39 @@ static int ion_heap_deferred_free(void *data)
 	struct ion_heap *heap = data;
 
 	while (true) {
-		struct ion_buffer *buffer;
+		struct ion_buffer *buffer, *tmp;
+		LIST_HEAD(batch);
+		size_t size = 0;
+		ktime_t queued;
 
 		wait_event_freezable(heap->waitqueue,
 				     ion_heap_freelist_size(heap) > 0);
 
+		/*
+		 * Take everything that queued up, so the heap can clear the
+		 * whole batch at once.  Bound it so that memory keeps flowing
+		 * back while a large teardown is in progress.
+		 */
 		spin_lock(&heap->free_lock);
-		if (list_empty(&heap->free_list)) {
-			spin_unlock(&heap->free_lock);
-			continue;
+		while (!list_empty(&heap->free_list) &&
+		       size < ION_HEAP_FREE_BATCH) {
+			buffer = list_first_entry(&heap->free_list,
+						  struct ion_buffer, list);
+			list_move_tail(&buffer->list, &batch);
+			heap->free_list_size -= buffer->size;
+			heap->free_list_count--;
+			size += buffer->size;
 		}
-		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
-					  list);
-		list_del(&buffer->list);
-		heap->free_list_size -= buffer->size;
 		spin_unlock(&heap->free_lock);
-		ion_buffer_destroy(buffer);
+
+		if (heap->ops->prepare_free)
+			heap->ops->prepare_free(heap, &batch);
+
+		list_for_each_entry_safe(buffer, tmp, &batch, list) {
+			queued = buffer->free_time;
+			ion_buffer_destroy(buffer);
+			ion_heap_free_done(heap, queued);
+		}
 	}
 
 	return 0;
@@ -274,8 +313,8 @@ static int ion_heap_shrink(struct shrinker *shrinker, struct shrink_control *sc)
 	 * just going to reclaim it
 	 */
 	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
-		freed = ion_heap_freelist_drain(heap, to_scan * PAGE_SIZE) /
-				PAGE_SIZE;
+		freed = ion_heap_freelist_drain_from_shrinker(heap,
+				to_scan * PAGE_SIZE) / PAGE_SIZE;
 
 	to_scan -= freed;
 	if (to_scan < 0)
@@ -20,22 +20,24 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/swap.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+				       gfp_t gfp_mask, bool zero)
 {
 	struct page *page;
 
-	page = alloc_pages(pool->gfp_mask & ~__GFP_ZERO, pool->order);
+	page = alloc_pages(gfp_mask & ~__GFP_ZERO, pool->order);
 
 	if (!page)
 		return NULL;
 	mod_zone_page_state(page_zone(page), NR_ION_PAGES, 1 << pool->order);
 
-	if (pool->gfp_mask & __GFP_ZERO)
+	if (zero)
 		if (msm_ion_heap_high_order_page_zero(page, pool->order))
 			goto error_free_pages;
 
@@ -53,9 +55,8 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	mod_zone_page_state(page_zone(page), NR_ION_PAGES, -(1 << pool->order));
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+static void __ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
-	mutex_lock(&pool->mutex);
 	if (PageHighMem(page)) {
 		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
@@ -63,8 +64,16 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
-	mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
-			1 << pool->order);
+}
+
+static int ion_page_pool_add(struct ion_page_pool *pool, struct page **pages,
+			     int nr)
+{
+	int i;
+
+	mutex_lock(&pool->mutex);
+	for (i = 0; i < nr; i++)
+		__ion_page_pool_add(pool, pages[i]);
 	mutex_unlock(&pool->mutex);
 	return 0;
 }
@@ -84,28 +93,112 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	}
 
 	list_del(&page->lru);
-	mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
-			-(1 << pool->order));
 	return page;
 }
 
+/* Stash items in the local magazine, returns how many didn't fit */
+static int ion_page_pool_cache_add(struct ion_page_pool *pool,
+				   struct page **pages, int nr)
+{
+	struct ion_page_pool_cache *cache;
+
+	cache = get_cpu_ptr(pool->cache);
+	spin_lock(&cache->lock);
+	while (nr && cache->count < pool->cache_size)
+		cache->pages[cache->count++] = pages[--nr];
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(pool->cache);
+
+	return nr;
+}
+
+static struct page *ion_page_pool_cache_remove(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_cache *cache;
+	struct page *page = NULL;
+
+	cache = get_cpu_ptr(pool->cache);
+	spin_lock(&cache->lock);
+	if (cache->count)
+		page = cache->pages[--cache->count];
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(pool->cache);
+
+	return page;
+}
+
+/* Move the items of all magazines back to the shared lists */
+static void ion_page_pool_cache_drain(struct ion_page_pool *pool)
+{
+	struct page *pages[ION_POOL_CACHE_MAX];
+	int cpu, nr;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache;
+
+		cache = per_cpu_ptr(pool->cache, cpu);
+		spin_lock(&cache->lock);
+		nr = cache->count;
+		memcpy(pages, cache->pages, nr * sizeof(*pages));
+		cache->count = 0;
+		spin_unlock(&cache->lock);
+
+		if (nr)
+			ion_page_pool_add(pool, pages, nr);
+	}
+}
+
+static int ion_page_pool_cache_count(struct ion_page_pool *pool)
+{
+	int cpu, count = 0;
+
+	if (!pool->cache)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+		count += ACCESS_ONCE(per_cpu_ptr(pool->cache, cpu)->count);
+
+	return count;
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
 {
+	struct page *pages[ION_POOL_CACHE_MAX];
 	struct page *page = NULL;
+	int nr = 0, batch = 1;
 
 	BUG_ON(!pool);
 
 	*from_pool = true;
 
+	if (pool->cache) {
+		page = ion_page_pool_cache_remove(pool);
+		if (page)
+			goto out;
+		batch = DIV_ROUND_UP(pool->cache_size, 2);
+	}
+
+	/* Refill the magazine along with this allocation */
 	if (mutex_trylock(&pool->mutex)) {
-		if (pool->high_count)
-			page = ion_page_pool_remove(pool, true);
-		else if (pool->low_count)
-			page = ion_page_pool_remove(pool, false);
+		while (nr < batch && (pool->high_count || pool->low_count))
+			pages[nr++] = ion_page_pool_remove(pool,
+							   pool->high_count);
 		mutex_unlock(&pool->mutex);
 	}
-	if (!page) {
-		page = ion_page_pool_alloc_pages(pool);
+	if (nr) {
+		page = pages[--nr];
+		if (nr)
+			nr = ion_page_pool_cache_add(pool, pages, nr);
+		if (nr)
+			ion_page_pool_add(pool, pages, nr);
+	}
+out:
+	if (page) {
+		mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
+				-(1 << pool->order));
+	} else {
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask,
+						 pool->gfp_mask & __GFP_ZERO);
 		*from_pool = false;
 	}
 	return page;
@@ -113,18 +206,67 @@ void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 {
-	int ret;
+	struct page *pages[ION_POOL_CACHE_MAX];
+	struct ion_page_pool_cache *cache;
+	int ret, nr = 0;
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+	mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
+			1 << pool->order);
+
+	if (!pool->cache) {
+		ret = ion_page_pool_add(pool, &page, 1);
+		if (ret) {
+			mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
+					-(1 << pool->order));
+			ion_page_pool_free_pages(pool, page);
+		}
+		return;
+	}
+
+	/* A full magazine hands half of its items to the shared lists */
+	cache = get_cpu_ptr(pool->cache);
+	spin_lock(&cache->lock);
+	if (cache->count == pool->cache_size) {
+		nr = DIV_ROUND_UP(pool->cache_size, 2);
+		cache->count -= nr;
+		memcpy(pages, &cache->pages[cache->count], nr * sizeof(*pages));
+	}
+	cache->pages[cache->count++] = page;
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(pool->cache);
+
+	if (nr)
+		ion_page_pool_add(pool, pages, nr);
+}
+
+int ion_page_pool_count(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count +
+		ion_page_pool_cache_count(pool);
+}
+
+int ion_page_pool_fill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask & ~__GFP_WAIT) | __GFP_NOWARN |
+			 __GFP_NORETRY | __GFP_NO_KSWAPD;
+	struct page *page;
+
+	page = ion_page_pool_alloc_pages(pool, gfp_mask, true);
+	if (!page)
+		return -ENOMEM;
+
+	mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
+			1 << pool->order);
+	ion_page_pool_add(pool, &page, 1);
+	return 0;
 }
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
 	int total = 0;
 
-	total += high ? (pool->high_count + pool->low_count) *
+	total += high ? (pool->high_count + pool->low_count +
+			 ion_page_pool_cache_count(pool)) *
 		(1 << pool->order) :
 			pool->low_count * (1 << pool->order);
 	return total;
@@ -141,6 +283,9 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	else
 		high = !!(gfp_mask & __GFP_HIGHMEM);
 
+	if (nr_to_scan && pool->cache)
+		ion_page_pool_cache_drain(pool);
+
 	for (i = 0; i < nr_to_scan; i++) {
 		struct page *page;
 
@@ -154,6 +299,8 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 			break;
 		}
 		mutex_unlock(&pool->mutex);
+		mod_zone_page_state(page_zone(page), NR_ION_POOL_PAGES,
+				-(1 << pool->order));
 		ion_page_pool_free_pages(pool, page);
 	}
 
@@ -175,11 +322,45 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 	mutex_init(&pool->mutex);
 	plist_node_init(&pool->list, order);
 
+	pool->cache = NULL;
+	pool->cache_size = min_t(int, ION_POOL_CACHE_MAX,
+				 ION_POOL_CACHE_BYTES >> (PAGE_SHIFT + order));
+	if (pool->cache_size) {
+		int cpu;
+
+		pool->cache = alloc_percpu(struct ion_page_pool_cache);
+		if (!pool->cache) {
+			kfree(pool);
+			return NULL;
+		}
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(pool->cache, cpu)->lock);
+	}
+
 	return pool;
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	int cpu;
+
+	/* Pages still parked in the magazines would leak with the percpu area */
+	if (pool->cache) {
+		for_each_possible_cpu(cpu) {
+			struct ion_page_pool_cache *cache;
+
+			cache = per_cpu_ptr(pool->cache, cpu);
+			while (cache->count) {
+				struct page *page = cache->pages[--cache->count];
+
+				mod_zone_page_state(page_zone(page),
+						NR_ION_POOL_PAGES,
+						-(1 << pool->order));
+				ion_page_pool_free_pages(pool, page);
+			}
+		}
+	}
+	free_percpu(pool->cache);
 	kfree(pool);
 }
 
@@ -21,10 +21,14 @@
 #include <linux/device.h>
 #include <linux/dma-direction.h>
 #include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/spinlock.h>
 
 #include "msm_ion_priv.h"
 #include <linux/sched.h>
@@ -38,7 +42,9 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 /**
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
- * @node:		node in the ion_device buffers tree
+ * @index_node:		node in the ion_device buffer index
+ * @list:		entry on the heap's deferred free list
+ * @rcu:		used to free the buffer after index walkers are done
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -64,13 +70,13 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  *			handle, used for debugging
  * @pid:		pid of last client to reference this buffer in a
  *			handle, used for debugging
+ * @free_time:		when the buffer was put on the deferred free list
 */
 struct ion_buffer {
 	struct kref ref;
-	union {
-		struct rb_node node;
-		struct list_head list;
-	};
+	struct hlist_node index_node;
+	struct list_head list;
+	struct rcu_head rcu;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -90,6 +96,7 @@ struct ion_buffer {
 	int handle_count;
 	char task_comm[TASK_COMM_LEN];
 	pid_t pid;
+	ktime_t free_time;
 };
 void ion_buffer_destroy(struct ion_buffer *buffer);
 
@@ -109,6 +116,11 @@ void ion_buffer_destroy(struct ion_buffer *buffer);
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
  * @unmap_user		unmap memory to userspace
+ * @prepare_free	optional, called by the deferred free thread with a
+ *			batch of buffers about to be freed, linked through
+ *			buffer->list.  Lets the heap clear them in one pass;
+ *			buffers it cleared get ION_PRIV_FLAG_CLEARED so that
+ *			@free can skip that work.
  *
  * allocate, phys, and map_user return 0 on success, -errno on error.
  * map_dma and map_kernel return pointer on success, ERR_PTR on
@@ -132,6 +144,7 @@ struct ion_heap_ops {
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
 	void (*unmap_user) (struct ion_heap *mapper, struct ion_buffer *buffer);
+	void (*prepare_free) (struct ion_heap *heap, struct list_head *buffers);
 	int (*shrink)(struct ion_heap *heap, gfp_t gfp_mask, int nr_to_scan);
 	int (*print_debug)(struct ion_heap *heap, struct seq_file *s,
 			   const struct list_head *mem_map);
@@ -153,6 +166,12 @@ struct ion_heap_ops {
  */
 #define ION_PRIV_FLAG_SHRINKER_FREE (1 << 0)
 
+/*
+ * Buffer contents were already zeroed and cleaned from the caches by the
+ * heap's prepare_free op.
+ */
+#define ION_PRIV_FLAG_CLEARED (1 << 1)
+
 
 /**
  * struct ion_heap - represents a heap in the system
@@ -169,7 +188,12 @@ struct ion_heap_ops {
  * @priv:		private heap data
  * @free_list:		free list head if deferred free is used
  * @free_list_size	size of the deferred free list in bytes
- * @lock:		protects the free list
+ * @free_list_count:	number of buffers on the deferred free list
+ * @free_drained:	number of buffers the deferred free path released
+ * @free_latency_total_us: sum of the times those buffers spent between
+ *			being queued and released
+ * @free_latency_max_us: longest such time
+ * @lock:		protects the free list and the counters above
  * @waitqueue:		queue to wait on from deferred free thread
  * @task:		task struct of deferred free thread
  * @debug_show:		called when heap debug file is read to add any
@@ -192,6 +216,10 @@ struct ion_heap {
 	void *priv;
 	struct list_head free_list;
 	size_t free_list_size;
+	unsigned long free_list_count;
+	unsigned long free_drained;
+	u64 free_latency_total_us;
+	u64 free_latency_max_us;
 	spinlock_t free_lock;
 	wait_queue_head_t waitqueue;
 	struct task_struct *task;
@@ -387,6 +415,22 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * invalidated from the cache, provides a significant peformance benefit on
  * many systems */
 
+#define ION_POOL_CACHE_MAX	16
+#define ION_POOL_CACHE_BYTES	SZ_256K
+
+/**
+ * struct ion_page_pool_cache - per-cpu magazine in front of a pool
+ * @lock:		protects the magazine, only contended when the
+ *			shrinker drains it from another cpu
+ * @count:		number of items in @pages
+ * @pages:		the cached items
+ */
+struct ion_page_pool_cache {
+	spinlock_t lock;
+	int count;
+	struct page *pages[ION_POOL_CACHE_MAX];
+};
+
 /**
  * struct ion_page_pool - pagepool struct
  * @high_count:		number of highmem items in the pool
@@ -398,11 +442,16 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @cache:		per-cpu magazines, NULL for orders too large to cache
+ * @cache_size:		capacity of each magazine
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
  * on many systems
+ *
+ * Frees and allocations go through the magazine of the local cpu first and
+ * move items to and from the shared lists in batches of half a magazine.
  */
 struct ion_page_pool {
 	int high_count;
@@ -413,6 +462,8 @@ struct ion_page_pool {
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct ion_page_pool_cache __percpu *cache;
+	int cache_size;
 };
 
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
@@ -420,6 +471,20 @@ void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *, bool *from_pool);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 
+/**
+ * ion_page_pool_count - number of items in the pool, magazines included
+ * @pool:		the pool
+ */
+int ion_page_pool_count(struct ion_page_pool *pool);
+
+/**
+ * ion_page_pool_fill - add a zeroed item to the pool from free memory
+ * @pool:		the pool
+ *
+ * Never enters reclaim.  Returns 0 on success or -ENOMEM.
+ */
+int ion_page_pool_fill(struct ion_page_pool *pool);
+
 /** ion_page_pool_shrink - shrinks the size of the memory cached in the pool
  * @pool:		the pool
  * @gfp_mask:		the memory type to reclaim
@@ -18,12 +18,17 @@
 #include <asm/page.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/highmem.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
+#include <linux/compaction.h>
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "ion.h"
 #include "ion_priv.h"
 #include <linux/dma-mapping.h>
@@ -41,6 +46,23 @@ static const unsigned int orders[] = {0};
 #endif
 
 static const int num_orders = ARRAY_SIZE(orders);
+
+/*
+ * Amount of zeroed memory a low priority thread keeps in the uncached
+ * pools, so that allocations don't have to clear pages when the pools
+ * run dry.  Larger orders are filled first.
+ */
+static unsigned int pool_reserve_kb;
+module_param(pool_reserve_kb, uint, 0644);
+
+/*
+ * Number of failed high-order attempts after which background (async)
+ * compaction is queued for the largest order, so that later buffers end
+ * up with fewer, larger chunks.  0 disables it.
+ */
+static unsigned int compact_miss_threshold;
+module_param(compact_miss_threshold, uint, 0644);
+
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -61,6 +83,14 @@ struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **uncached_pools;
 	struct ion_page_pool **cached_pools;
+	struct task_struct *refill_task;
+	wait_queue_head_t refill_wait;
+	bool refill_pending;
+	atomic_t order_hits[ARRAY_SIZE(orders)];
+	atomic_t order_misses[ARRAY_SIZE(orders)];
+	atomic_t compact_misses;
+	atomic_t compact_runs;
+	struct work_struct compact_work;
 };
 
 struct page_info {
@@ -109,6 +139,29 @@ static void free_buffer_page(struct ion_system_heap *heap,
 	}
 }
 
+static void ion_system_heap_compact(struct work_struct *work)
+{
+	struct ion_system_heap *sys_heap = container_of(work,
+							struct ion_system_heap,
+							compact_work);
+	pg_data_t *pgdat;
+
+	for_each_online_pgdat(pgdat)
+		compact_pgdat(pgdat, orders[0]);
+	atomic_inc(&sys_heap->compact_runs);
+}
+
+static void ion_system_heap_note_miss(struct ion_system_heap *sys_heap)
+{
+	unsigned int threshold = ACCESS_ONCE(compact_miss_threshold);
+
+	if (!threshold ||
+	    atomic_inc_return(&sys_heap->compact_misses) < threshold)
+		return;
+
+	atomic_set(&sys_heap->compact_misses, 0);
+	queue_work(system_unbound_wq, &sys_heap->compact_work);
+}
 
 static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 						 struct ion_buffer *buffer,
@@ -131,8 +184,13 @@ static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 			continue;
 
 		page = alloc_buffer_page(heap, buffer, orders[i], &from_pool);
-		if (!page)
+		if (!page) {
+			atomic_inc(&heap->order_misses[i]);
+			if (orders[i])
+				ion_system_heap_note_miss(heap);
 			continue;
+		}
+		atomic_inc(&heap->order_hits[i]);
 
 		info->page = page;
 		info->order = orders[i];
@@ -172,6 +230,63 @@ static unsigned int process_info(struct page_info *info,
 	return i;
 }
 
+static unsigned long ion_system_heap_reserve_bytes(
+					struct ion_system_heap *sys_heap)
+{
+	unsigned long total = 0;
+	int i;
+
+	for (i = 0; i < num_orders; i++)
+		total += ion_page_pool_count(sys_heap->uncached_pools[i]) *
+			order_to_size(orders[i]);
+
+	return total;
+}
+
+static bool ion_system_heap_reserve_low(struct ion_system_heap *sys_heap)
+{
+	unsigned long reserve = (unsigned long)ACCESS_ONCE(pool_reserve_kb) *
+				SZ_1K;
+
+	return ion_system_heap_reserve_bytes(sys_heap) < reserve;
+}
+
+static int ion_system_heap_refill(void *data)
+{
+	struct ion_system_heap *sys_heap = data;
+	int i;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(sys_heap->refill_wait,
+				     sys_heap->refill_pending ||
+				     kthread_should_stop());
+		sys_heap->refill_pending = false;
+
+		/* Fall back to smaller orders once free memory runs short */
+		for (i = 0; i < num_orders; i++) {
+			struct ion_page_pool *pool = sys_heap->uncached_pools[i];
+
+			while (ion_system_heap_reserve_low(sys_heap) &&
+			       !kthread_should_stop())
+				if (ion_page_pool_fill(pool))
+					break;
+		}
+	}
+
+	return 0;
+}
+
+static void ion_system_heap_kick_refill(struct ion_system_heap *sys_heap)
+{
+	if (!sys_heap->refill_task || !ion_system_heap_reserve_low(sys_heap))
+		return;
+
+	sys_heap->refill_pending = true;
+	wake_up(&sys_heap->refill_wait);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
@@ -290,6 +405,7 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	if (nents_sync)
 		sg_free_table(&table_sync);
 	msm_ion_heap_free_pages_mem(&data);
+	ion_system_heap_kick_refill(sys_heap);
 	return 0;
 err_free_sg2:
 	/* We failed to zero buffers. Bypass pool */
@@ -329,7 +445,8 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 	LIST_HEAD(pages);
 	int i;
 
-	if (!(buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE))
+	if (!(buffer->private_flags & (ION_PRIV_FLAG_SHRINKER_FREE |
+				       ION_PRIV_FLAG_CLEARED)))
 		msm_ion_heap_buffer_zero(buffer);
 
 	for_each_sg(table->sgl, sg, table->nents, i)
@@ -339,6 +456,55 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 	kfree(table);
 }
 
+/*
+ * Zero a batch of buffers headed back to the pools with one mapping pass,
+ * then clean them from the caches back to back.  On failure the buffers
+ * are left alone and ion_system_heap_free() clears them one at a time.
+ */
+static void ion_system_heap_prepare_free(struct ion_heap *heap,
+					 struct list_head *buffers)
+{
+	struct ion_buffer *buffer;
+	struct scatterlist *sg;
+	struct pages_mem data;
+	int i, j, npages = 0;
+
+	data.size = 0;
+	list_for_each_entry(buffer, buffers, list)
+		if (!(buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE))
+			data.size += PAGE_ALIGN(buffer->size);
+	if (!data.size || msm_ion_heap_alloc_pages_mem(&data))
+		return;
+
+	list_for_each_entry(buffer, buffers, list) {
+		struct sg_table *table = buffer->sg_table;
+
+		if (buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE)
+			continue;
+		for_each_sg(table->sgl, sg, table->nents, i) {
+			/* needed to make dma_sync_sg_for_device work: */
+			sg->dma_address = sg_phys(sg);
+			for (j = 0; j < sg->length / PAGE_SIZE; j++)
+				data.pages[npages++] = sg_page(sg) + j;
+		}
+	}
+
+	if (msm_ion_heap_pages_zero(data.pages, npages))
+		goto out;
+
+	list_for_each_entry(buffer, buffers, list) {
+		struct sg_table *table = buffer->sg_table;
+
+		if (buffer->private_flags & ION_PRIV_FLAG_SHRINKER_FREE)
+			continue;
+		dma_sync_sg_for_device(NULL, table->sgl, table->nents,
+				       DMA_BIDIRECTIONAL);
+		buffer->private_flags |= ION_PRIV_FLAG_CLEARED;
+	}
+out:
+	msm_ion_heap_free_pages_mem(&data);
+}
+
 struct sg_table *ion_system_heap_map_dma(struct ion_heap *heap,
 					 struct ion_buffer *buffer)
 {
@@ -381,6 +547,7 @@ static struct ion_heap_ops system_heap_ops = {
 	.map_kernel = ion_heap_map_kernel,
 	.unmap_kernel = ion_heap_unmap_kernel,
 	.map_user = ion_heap_map_user,
+	.prepare_free = ion_system_heap_prepare_free,
 	.shrink = ion_system_heap_shrink,
 };
 
@@ -399,6 +566,8 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->uncached_pools[i];
+		int cpu_count = ion_page_pool_count(pool) - pool->high_count -
+				pool->low_count;
 
 		if (use_seq) {
 			seq_printf(s,
@@ -411,16 +580,24 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				pool->low_count, pool->order,
 				(1 << pool->order) * PAGE_SIZE *
 					pool->low_count);
+			seq_printf(s,
+				"%d order %u pages in uncached per-cpu caches = %lu total\n",
+				cpu_count, pool->order,
+				(1 << pool->order) * PAGE_SIZE * cpu_count);
 		}
 
 		uncached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->high_count;
 		uncached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		uncached_total += (1 << pool->order) * PAGE_SIZE * cpu_count;
 	}
 
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->cached_pools[i];
+		int cpu_count = ion_page_pool_count(pool) - pool->high_count -
+				pool->low_count;
+
 		if (use_seq) {
 			seq_printf(s,
 				"%d order %u highmem pages in cached pool = %lu total\n",
@@ -431,15 +608,27 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				pool->low_count, pool->order,
 				(1 << pool->order) * PAGE_SIZE *
 					pool->low_count);
+			seq_printf(s,
+				"%d order %u pages in cached per-cpu caches = %lu total\n",
+				cpu_count, pool->order,
+				(1 << pool->order) * PAGE_SIZE * cpu_count);
 		}
 
 		cached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->high_count;
 		cached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		cached_total += (1 << pool->order) * PAGE_SIZE * cpu_count;
 	}
 
 	if (use_seq) {
+		for (i = 0; i < num_orders; i++)
+			seq_printf(s, "order %u allocations: %d hits %d misses\n",
+				   orders[i],
+				   atomic_read(&sys_heap->order_hits[i]),
+				   atomic_read(&sys_heap->order_misses[i]));
+		seq_printf(s, "background compactions: %d\n",
+			   atomic_read(&sys_heap->compact_runs));
 		seq_puts(s, "--------------------------------------------\n");
 		seq_printf(s, "uncached pool = %lu cached pool = %lu\n",
 				uncached_total, cached_total);
@@ -520,6 +709,20 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 	if (ion_system_heap_create_pools(heap->cached_pools))
 		goto err_create_cached_pools;
 
+	INIT_WORK(&heap->compact_work, ion_system_heap_compact);
+	init_waitqueue_head(&heap->refill_wait);
+	heap->refill_task = kthread_run(ion_system_heap_refill, heap,
+					"ion_pool_refill");
+	if (IS_ERR(heap->refill_task)) {
+		pr_err("%s: creating thread for pool refill failed\n",
+		       __func__);
+		heap->refill_task = NULL;
+	} else {
+		struct sched_param param = { .sched_priority = 0 };
+
+		sched_setscheduler(heap->refill_task, SCHED_IDLE, &param);
+	}
+
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	return &heap->heap;
 
@@ -540,6 +743,9 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 							struct ion_system_heap,
 							heap);
 
+	if (sys_heap->refill_task)
+		kthread_stop(sys_heap->refill_task);
+	cancel_work_sync(&sys_heap->compact_work);
 	ion_system_heap_destroy_pools(sys_heap->uncached_pools);
 	ion_system_heap_destroy_pools(sys_heap->cached_pools);
 	kfree(sys_heap->uncached_pools);
@@ -18,20 +18,34 @@
 #include <linux/dma-buf.h>
 #include <linux/dma-direction.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/msm_ion.h>
 #include <linux/platform_device.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "ion.h"
 #include "../uapi/ion_test.h"
 
 #define u64_to_uptr(x) ((void __user *)(unsigned long)(x))
 
+#define ION_TEST_BENCH_MAX_COUNT	1024
+#define ION_TEST_BENCH_MAX_THREADS	16
+
+struct ion_test_bench_work {
+	struct work_struct work;
+	struct ion_test_alloc_bench *bench;
+	u64 total_ns;
+	u64 max_ns;
+	int ret;
+};
+
 struct ion_test_device {
 	struct miscdevice misc;
 };
@@ -143,6 +157,98 @@ err:
 	return ret;
 }
 
+static int ion_test_bench_run(struct ion_test_alloc_bench *bench,
+			      u64 *total_ns, u64 *max_ns)
+{
+	struct ion_client *client;
+	struct ion_handle **handles;
+	ktime_t start;
+	u64 ns;
+	int i, ret = 0;
+
+	handles = kcalloc(bench->count, sizeof(*handles), GFP_KERNEL);
+	if (!handles)
+		return -ENOMEM;
+
+	client = msm_ion_client_create("ion-test");
+	if (IS_ERR(client)) {
+		ret = PTR_ERR(client);
+		goto out;
+	}
+
+	*total_ns = 0;
+	*max_ns = 0;
+	for (i = 0; i < bench->count; i++) {
+		start = ktime_get();
+		handles[i] = ion_alloc(client, bench->len, 0,
+				       bench->heap_id_mask, bench->flags);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (IS_ERR(handles[i])) {
+			ret = PTR_ERR(handles[i]);
+			break;
+		}
+		*total_ns += ns;
+		*max_ns = max(*max_ns, ns);
+	}
+
+	while (--i >= 0)
+		ion_free(client, handles[i]);
+	ion_client_destroy(client);
+out:
+	kfree(handles);
+	return ret;
+}
+
+static void ion_test_bench_work_fn(struct work_struct *work)
+{
+	struct ion_test_bench_work *w =
+		container_of(work, struct ion_test_bench_work, work);
+
+	w->ret = ion_test_bench_run(w->bench, &w->total_ns, &w->max_ns);
+}
+
+/*
+ * Each thread gets its own client so that contention is on the device
+ * wide state (buffer index, heaps, pools) rather than on a client lock.
+ */
+static int ion_test_alloc_bench(struct ion_test_alloc_bench *bench)
+{
+	struct ion_test_bench_work *works;
+	unsigned int threads = bench->threads ? bench->threads : 1;
+	int i, ret = 0;
+
+	if (!bench->count || bench->count > ION_TEST_BENCH_MAX_COUNT ||
+	    threads > ION_TEST_BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	if (threads == 1)
+		return ion_test_bench_run(bench, &bench->total_ns,
+					  &bench->max_ns);
+
+	works = kcalloc(threads, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		INIT_WORK(&works[i].work, ion_test_bench_work_fn);
+		works[i].bench = bench;
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+
+	bench->total_ns = 0;
+	bench->max_ns = 0;
+	for (i = 0; i < threads; i++) {
+		flush_work(&works[i].work);
+		if (works[i].ret && !ret)
+			ret = works[i].ret;
+		bench->total_ns += works[i].total_ns;
+		bench->max_ns = max(bench->max_ns, works[i].max_ns);
+	}
+
+	kfree(works);
+	return ret;
+}
+
 static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 						unsigned long arg)
 {
@@ -151,6 +257,7 @@ static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 
 	union {
 		struct ion_test_rw_data test_rw;
+		struct ion_test_alloc_bench bench;
 	} data;
 
 	if (_IOC_SIZE(cmd) > sizeof(data))
@@ -192,12 +299,17 @@ static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 					data.test_rw.write);
 		break;
 	}
+	case ION_IOC_TEST_ALLOC_BENCH:
+	{
+		ret = ion_test_alloc_bench(&data.bench);
+		break;
+	}
 	default:
 		return -ENOTTY;
 	}
 
 	if (_IOC_DIR(cmd) & _IOC_READ) {
-		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+		if (copy_to_user((void __user *)arg, &data, _IOC_SIZE(cmd)))
 			return -EFAULT;
 	}
 	return ret;
@@ -46,6 +46,7 @@
 #include <linux/cpuset.h>
 #include <linux/show_mem_notifier.h>
 #include <linux/vmpressure.h>
+#include <linux/ktime.h>
 
 #include <trace/events/memkill.h>
 
@@ -81,6 +82,15 @@ static int lmk_fast_run = 1;
 
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Cost of the victim search in the last shrinker pass that reached it,
+ * and the worst seen since the max was last cleared by writing 0.
+ */
+static unsigned int lowmem_scan_tasks;
+static unsigned int lowmem_scan_tasks_max;
+static unsigned int lowmem_scan_us;
+static unsigned int lowmem_scan_us_max;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -402,11 +412,22 @@ void tune_lmk_param(int *other_free, int *other_file, struct shrink_control *sc,
 }
 
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-static struct task_struct *pick_next_from_adj_tree(struct task_struct *task);
-static struct task_struct *pick_first_task(void);
-static struct task_struct *pick_last_task(void);
+static struct task_struct *lmk_next_task(struct task_struct *prev,
+					 short *adj);
 #endif
 
+static void lowmem_update_scan_stats(ktime_t start, unsigned int tasks)
+{
+	lowmem_scan_us = ktime_us_delta(ktime_get(), start);
+	lowmem_scan_tasks = tasks;
+	if (lowmem_scan_us > lowmem_scan_us_max)
+		lowmem_scan_us_max = lowmem_scan_us;
+	if (lowmem_scan_tasks > lowmem_scan_tasks_max)
+		lowmem_scan_tasks_max = lowmem_scan_tasks;
+	lowmem_print(4, "lowmem_shrink scanned %u tasks in %uus\n",
+		     lowmem_scan_tasks, lowmem_scan_us);
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *tsk;
@@ -424,6 +445,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int other_file;
 	unsigned long nr_to_scan = sc->nr_to_scan;
 	struct zone_avail zall[MAX_NUMNODES][MAX_NR_ZONES];
+	unsigned int scan_tasks = 0;
+	ktime_t scan_start;
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	short tree_adj;
+#endif
 
 	rcu_read_lock();
 	tsk = current->group_leader;
@@ -489,17 +515,26 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_score_adj = min_score_adj;
 
+	scan_start = ktime_get();
 	rcu_read_lock();
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-	for (tsk = pick_first_task();
-		tsk != pick_last_task() && tsk != NULL;
-		tsk = pick_next_from_adj_tree(tsk)) {
+	for (tsk = lmk_next_task(NULL, &tree_adj); tsk;
+	     tsk = lmk_next_task(tsk, &tree_adj)) {
 #else
 	for_each_process(tsk) {
 #endif
 		struct task_struct *p;
 		short oom_score_adj;
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+		/* the rest of the tree can't hold a better victim */
+		if (tree_adj < min_score_adj)
+			break;
+		if (selected && tree_adj < selected_oom_score_adj)
+			break;
+#endif
+		scan_tasks++;
+
 		if (tsk->flags & PF_KTHREAD)
 			continue;
 
@@ -564,6 +599,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_print(3, "select '%s' (%d), adj %hd, size %d, to kill\n",
 			     p->comm, p->pid, oom_score_adj, tasksize);
 	}
+	lowmem_update_scan_stats(scan_start, scan_tasks);
 	if (selected) {
 		int i, j;
 		char zinfo[ZINFO_LENGTH];
@@ -802,51 +838,61 @@ void delete_from_adj_tree(struct task_struct *task)
 	spin_unlock(&lmk_lock);
 }
 
-static struct task_struct *pick_next_from_adj_tree(struct task_struct *task)
+/* Leftmost node whose oom_score_adj is not above @adj, under lmk_lock */
+static struct rb_node *lmk_first_not_above(short adj)
 {
-	struct rb_node *next;
-	struct signal_struct *next_tsk_sig;
-
-	spin_lock(&lmk_lock);
-	next = rb_next(&task->signal->adj_node);
-	spin_unlock(&lmk_lock);
-
-	if (!next)
-		return NULL;
+	struct rb_node *node = tasks_scoreadj.rb_node;
+	struct rb_node *found = NULL;
+	struct signal_struct *sig;
+
+	while (node) {
+		sig = rb_entry(node, struct signal_struct, adj_node);
+		if (sig->oom_score_adj <= adj) {
+			found = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
 
-	next_tsk_sig = rb_entry(next, struct signal_struct, adj_node);
-	return next_tsk_sig->curr_target->group_leader;
+	return found;
 }
 
-static struct task_struct *pick_first_task(void)
+/*
+ * Walk the processes in descending oom_score_adj order: return the one
+ * after @prev, or the first one if @prev is NULL, and store its
+ * oom_score_adj in *@adj. On entry *@adj must hold the value returned
+ * with @prev. If @prev left the tree or was requeued since, the walk
+ * resumes at the first process with that oom_score_adj, which may visit
+ * a few processes twice but never skips one.
+ *
+ * The caller holds rcu_read_lock(): a group leader is only removed from
+ * the tree before it is released, so the returned task stays valid.
+ */
+static struct task_struct *lmk_next_task(struct task_struct *prev,
+					 short *adj)
 {
-	struct rb_node *left;
-	struct signal_struct *first_tsk_sig;
+	struct rb_node *node;
+	struct signal_struct *sig;
+	struct task_struct *next = NULL;
 
 	spin_lock(&lmk_lock);
-	left = rb_first(&tasks_scoreadj);
-	spin_unlock(&lmk_lock);
-
-	if (!left)
-		return NULL;
-
-	first_tsk_sig = rb_entry(left, struct signal_struct, adj_node);
-	return first_tsk_sig->curr_target->group_leader;
-}
-static struct task_struct *pick_last_task(void)
-{
-	struct rb_node *right;
-	struct signal_struct *last_tsk_sig;
+	if (!prev)
+		node = rb_first(&tasks_scoreadj);
+	else if (!RB_EMPTY_NODE(&prev->signal->adj_node) &&
+		 prev->signal->oom_score_adj == *adj)
+		node = rb_next(&prev->signal->adj_node);
+	else
+		node = lmk_first_not_above(*adj);
 
-	spin_lock(&lmk_lock);
-	right = rb_last(&tasks_scoreadj);
+	if (node) {
+		sig = rb_entry(node, struct signal_struct, adj_node);
+		next = sig->curr_target->group_leader;
+		*adj = sig->oom_score_adj;
+	}
 	spin_unlock(&lmk_lock);
 
-	if (!right)
-		return NULL;
-
-	last_tsk_sig = rb_entry(right, struct signal_struct, adj_node);
-	return last_tsk_sig->curr_target->group_leader;
+	return next;
 }
 #endif
 
@@ -866,6 +912,11 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 module_param_named(lmk_fast_run, lmk_fast_run, int, S_IRUGO | S_IWUSR);
+module_param_named(scan_tasks, lowmem_scan_tasks, uint, S_IRUGO);
+module_param_named(scan_tasks_max, lowmem_scan_tasks_max, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(scan_us, lowmem_scan_us, uint, S_IRUGO);
+module_param_named(scan_us_max, lowmem_scan_us_max, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
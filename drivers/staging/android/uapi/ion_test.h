@@ -35,6 +35,27 @@ struct ion_test_rw_data {
 	int __padding;
 };
 
+/**
+ * struct ion_test_alloc_bench - allocation benchmark parameters and results
+ * @len:		size of each buffer
+ * @heap_id_mask:	heaps to allocate from
+ * @flags:		allocation flags
+ * @count:		number of buffers to allocate in each thread
+ * @threads:		number of threads allocating in parallel, each with
+ *			its own client; 0 means 1
+ * @total_ns:		returned time spent in all allocations
+ * @max_ns:		returned time of the slowest allocation
+ */
+struct ion_test_alloc_bench {
+	__u64 len;
+	__u32 heap_id_mask;
+	__u32 flags;
+	__u32 count;
+	__u32 threads;
+	__u64 total_ns;
+	__u64 max_ns;
+};
+
 #define ION_IOC_MAGIC		'I'
 
 /**
@@ -66,5 +87,17 @@ struct ion_test_rw_data {
 #define ION_IOC_TEST_KERNEL_MAPPING \
 			_IOW(ION_IOC_MAGIC, 0xf2, struct ion_test_rw_data)
 
+/**
+ * DOC: ION_IOC_TEST_ALLOC_BENCH - time a burst of allocations
+ *
+ * Allocates count buffers back to back from a kernel client, the way a
+ * camera or video session sets up its buffers, then frees them all.  Only
+ * the allocations are timed.  With threads > 1 several such bursts run
+ * concurrently and the times are summed.  Only expected to be used for
+ * debugging and testing, may not always be available.
+ */
+#define ION_IOC_TEST_ALLOC_BENCH \
+			_IOWR(ION_IOC_MAGIC, 0xf3, struct ion_test_alloc_bench)
+
 
 #endif /* _UAPI_LINUX_ION_H */
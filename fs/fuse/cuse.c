@@ -502,7 +502,10 @@ static int cuse_channel_open(struct inode *inode, struct file *file)
 	if (!cc)
 		return -ENOMEM;
 
-	fuse_conn_init(&cc->fc);
+	if (fuse_conn_init(&cc->fc)) {
+		kfree(cc);
+		return -ENOMEM;
+	}
 
 	INIT_LIST_HEAD(&cc->list);
 	cc->fc.release = cuse_fc_release;
@@ -33,7 +33,8 @@ static struct fuse_conn *fuse_get_conn(struct file *file)
 {
 	/*
 	 * Lockless access is OK, because file->private data is set
-	 * once during mount and is valid until the file is released.
+	 * once during mount or FUSE_DEV_IOC_CLONE and is valid until
+	 * the file is released.
 	 */
 	return file->private_data;
 }
@@ -316,7 +317,8 @@ static void queue_request(struct fuse_conn *fc, struct fuse_req *req)
 {
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *) req->in.args);
-	list_add_tail(&req->list, &fc->pending);
+	list_add_tail(&req->list, &fc->pending[smp_processor_id()]);
+	fc->num_pending++;
 	req->state = FUSE_REQ_PENDING;
 	if (!req->waiting) {
 		req->waiting = 1;
@@ -373,6 +375,8 @@ __releases(fc->lock)
 {
 	void (*end) (struct fuse_conn *, struct fuse_req *) = req->end;
 	req->end = NULL;
+	if (req->state == FUSE_REQ_PENDING)
+		fc->num_pending--;
 	list_del(&req->list);
 	list_del(&req->intr_entry);
 	req->state = FUSE_REQ_FINISHED;
@@ -455,6 +459,7 @@ __acquires(fc->lock)
 
 		/* Request is not yet in userspace, bail out */
 		if (req->state == FUSE_REQ_PENDING) {
+			fc->num_pending--;
 			list_del(&req->list);
 			__fuse_put_request(req);
 			req->out.h.error = -EINTR;
@@ -691,6 +696,20 @@ static void fuse_copy_finish(struct fuse_copy_state *cs)
 	}
 }
 
+/*
+ * Give back the unused part of the current userspace page, so that the
+ * next request or reply of a batch starts where the previous one ended.
+ * Only valid for iovec based copies.
+ */
+static void fuse_copy_rewind(struct fuse_copy_state *cs)
+{
+	fuse_copy_finish(cs);
+	cs->seglen += cs->len;
+	cs->addr -= cs->len;
+	cs->len = 0;
+	cs->req = NULL;
+}
+
 /*
  * Get another pagefull of userspace buffer, and map it to kernel
  * address space, and lock request
@@ -1016,10 +1035,31 @@ static int forget_pending(struct fuse_conn *fc)
 
 static int request_pending(struct fuse_conn *fc)
 {
-	return !list_empty(&fc->pending) || !list_empty(&fc->interrupts) ||
+	return fc->num_pending || !list_empty(&fc->interrupts) ||
 		forget_pending(fc);
 }
 
+/*
+ * First request on the pending queues, starting with the queue of the
+ * reading CPU.  Requests queued elsewhere are picked up once the local
+ * queue is empty, or by readers running on those CPUs.
+ */
+static struct fuse_req *next_pending(struct fuse_conn *fc)
+{
+	unsigned cpu = smp_processor_id();
+	unsigned i;
+
+	for (i = 0; i < nr_cpu_ids; i++) {
+		struct list_head *head = &fc->pending[cpu];
+
+		if (!list_empty(head))
+			return list_entry(head->next, struct fuse_req, list);
+		if (++cpu == nr_cpu_ids)
+			cpu = 0;
+	}
+	return NULL;
+}
+
 /* Wait until a request is available on the pending list */
 static void request_wait(struct fuse_conn *fc)
 __releases(fc->lock)
@@ -1201,9 +1241,13 @@ __releases(fc->lock)
  * was an error during the copying then it's finished by calling
  * request_end().  Otherwise add it to the processing list, and set
  * the 'sent' flag.
+ *
+ * If 'batched' is set the buffer already holds earlier requests: don't
+ * wait, and return zero instead of taking a request that doesn't fit.
  */
-static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
-				struct fuse_copy_state *cs, size_t nbytes)
+static ssize_t fuse_dev_read_one(struct fuse_conn *fc, struct file *file,
+				 struct fuse_copy_state *cs, size_t nbytes,
+				 int batched)
 {
 	int err;
 	struct fuse_req *req;
@@ -1212,6 +1256,10 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 
  restart:
 	spin_lock(&fc->lock);
+	err = 0;
+	if (batched && (!fc->connected || !request_pending(fc)))
+		goto err_unlock;
+
 	err = -EAGAIN;
 	if ((file->f_flags & O_NONBLOCK) && fc->connected &&
 	    !request_pending(fc))
@@ -1225,23 +1273,36 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 	if (!request_pending(fc))
 		goto err_unlock;
 
+	err = 0;
 	if (!list_empty(&fc->interrupts)) {
+		if (batched && nbytes < sizeof(struct fuse_in_header) +
+					sizeof(struct fuse_interrupt_in))
+			goto err_unlock;
 		req = list_entry(fc->interrupts.next, struct fuse_req,
 				 intr_entry);
 		return fuse_read_interrupt(fc, cs, nbytes, req);
 	}
 
 	if (forget_pending(fc)) {
-		if (list_empty(&fc->pending) || fc->forget_batch-- > 0)
+		if (!fc->num_pending || fc->forget_batch-- > 0) {
+			if (batched &&
+			    nbytes < sizeof(struct fuse_in_header) +
+				     sizeof(struct fuse_batch_forget_in) +
+				     sizeof(struct fuse_forget_one))
+				goto err_unlock;
 			return fuse_read_forget(fc, cs, nbytes);
+		}
 
 		if (fc->forget_batch <= -8)
 			fc->forget_batch = 16;
 	}
 
-	req = list_entry(fc->pending.next, struct fuse_req, list);
+	req = next_pending(fc);
+	if (batched && nbytes < req->in.h.len)
+		goto err_unlock;
 	req->state = FUSE_REQ_READING;
 	list_move(&req->list, &fc->io);
+	fc->num_pending--;
 
 	in = &req->in;
 	reqsize = in->h.len;
@@ -1288,6 +1349,31 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 	return err;
 }
 
+/*
+ * With FUSE_BATCH_IO, fill the rest of the buffer with requests that are
+ * already queued, so that a metadata heavy workload doesn't cost the
+ * daemon a read() per request.  Splice reads stay one request per call.
+ */
+static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
+				struct fuse_copy_state *cs, size_t nbytes)
+{
+	ssize_t ret, done;
+
+	done = fuse_dev_read_one(fc, file, cs, nbytes, 0);
+	if (done <= 0 || !fc->batch_io || cs->pipebufs)
+		return done;
+
+	while (done < nbytes) {
+		fuse_copy_rewind(cs);
+		ret = fuse_dev_read_one(fc, file, cs, nbytes - done, 1);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
 static ssize_t fuse_dev_read(struct kiocb *iocb, const struct iovec *iov,
 			      unsigned long nr_segs, loff_t pos)
 {
@@ -1817,9 +1903,14 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc,
 	if (err)
 		goto err_finish;
 
+	/* A batched write may carry further replies after this one */
 	err = -EINVAL;
-	if (oh.len != nbytes)
-		goto err_finish;
+	if (oh.len != nbytes) {
+		if (!fc->batch_io || cs->pipebufs ||
+		    oh.len < sizeof(oh) || oh.len > nbytes)
+			goto err_finish;
+		nbytes = oh.len;
+	}
 
 	/*
 	 * Zero oh.unique indicates unsolicited notification message
@@ -1883,6 +1974,8 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc,
 	fuse_copy_finish(cs);
 
 	fuse_setup_shortcircuit(fc, req);
+	if (!err)
+		fuse_account_daemon_io(fc, req);
 
 	spin_lock(&fc->lock);
 	req->locked = 0;
@@ -1907,12 +2000,28 @@ static ssize_t fuse_dev_write(struct kiocb *iocb, const struct iovec *iov,
 {
 	struct fuse_copy_state cs;
 	struct fuse_conn *fc = fuse_get_conn(iocb->ki_filp);
+	size_t nbytes, done = 0;
+	ssize_t ret;
+
 	if (!fc)
 		return -EPERM;
 
 	fuse_copy_init(&cs, fc, 0, iov, nr_segs);
+	nbytes = iov_length(iov, nr_segs);
+
+	/*
+	 * Process replies until the buffer is used up.  If one of them
+	 * fails, report how far we got so the daemon can retry the rest.
+	 */
+	do {
+		ret = fuse_dev_do_write(fc, &cs, nbytes - done);
+		if (ret < 0)
+			return done ? done : ret;
+		done += ret;
+		fuse_copy_rewind(&cs);
+	} while (fc->batch_io && done < nbytes);
 
-	return fuse_dev_do_write(fc, &cs, iov_length(iov, nr_segs));
+	return done;
 }
 
 static ssize_t fuse_dev_splice_write(struct pipe_inode_info *pipe,
@@ -2071,9 +2180,12 @@ static void end_queued_requests(struct fuse_conn *fc)
 __releases(fc->lock)
 __acquires(fc->lock)
 {
+	int cpu;
+
 	fc->max_background = UINT_MAX;
 	flush_bg_queue(fc);
-	end_requests(fc, &fc->pending);
+	for_each_possible_cpu(cpu)
+		end_requests(fc, &fc->pending[cpu]);
 	end_requests(fc, &fc->processing);
 	while (forget_pending(fc))
 		kfree(dequeue_forget(fc, 1, NULL));
@@ -2135,6 +2247,11 @@ int fuse_dev_release(struct inode *inode, struct file *file)
 {
 	struct fuse_conn *fc = fuse_get_conn(file);
 	if (fc) {
+		/* Cloned device files keep the connection alive */
+		if (!atomic_dec_and_test(&fc->dev_count)) {
+			fuse_conn_put(fc);
+			return 0;
+		}
 		spin_lock(&fc->lock);
 		fc->connected = 0;
 		fc->blocked = 0;
@@ -2160,6 +2277,53 @@ static int fuse_dev_fasync(int fd, struct file *file, int on)
 	return fasync_helper(fd, file, on, &fc->fasync);
 }
 
+static int fuse_device_clone(struct fuse_conn *fc, struct file *new)
+{
+	/* Device is already in use */
+	if (new->private_data)
+		return -EINVAL;
+
+	atomic_inc(&fc->dev_count);
+	new->private_data = fuse_conn_get(fc);
+
+	return 0;
+}
+
+/*
+ * FUSE_DEV_IOC_CLONE attaches a freshly opened /dev/fuse to the
+ * connection of an existing one, so that each daemon thread can read
+ * and reply through its own file.
+ */
+static long fuse_dev_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct file *old;
+	struct fuse_conn *fc;
+	u32 oldfd;
+	int err;
+
+	if (cmd != FUSE_DEV_IOC_CLONE)
+		return -ENOTTY;
+
+	if (get_user(oldfd, (u32 __user *) arg))
+		return -EFAULT;
+
+	old = fget(oldfd);
+	if (!old)
+		return -EINVAL;
+
+	err = -EINVAL;
+	fc = fuse_get_conn(old);
+	if (old->f_op == &fuse_dev_operations && fc) {
+		mutex_lock(&fuse_mutex);
+		err = fuse_device_clone(fc, file);
+		mutex_unlock(&fuse_mutex);
+	}
+	fput(old);
+
+	return err;
+}
+
 const struct file_operations fuse_dev_operations = {
 	.owner		= THIS_MODULE,
 	.llseek		= no_llseek,
@@ -2172,6 +2336,8 @@ const struct file_operations fuse_dev_operations = {
 	.poll		= fuse_dev_poll,
 	.release	= fuse_dev_release,
 	.fasync		= fuse_dev_fasync,
+	.unlocked_ioctl	= fuse_dev_ioctl,
+	.compat_ioctl	= fuse_dev_ioctl,
 };
 EXPORT_SYMBOL_GPL(fuse_dev_operations);
 
@@ -33,7 +33,7 @@
 #define FUSE_NAME_MAX 1024
 
 /** Number of dentries for each connection in the control filesystem */
-#define FUSE_CTL_NUM_DENTRIES 5
+#define FUSE_CTL_NUM_DENTRIES 6
 
 /** If the FUSE_DEFAULT_PERMISSIONS flag is given, the filesystem
     module will check permissions based on the file mode.  Otherwise no
@@ -408,8 +408,14 @@ struct fuse_conn {
 	/** Readers of the connection are waiting on this */
 	wait_queue_head_t waitq;
 
-	/** The list of pending requests */
-	struct list_head pending;
+	/** Per-CPU lists of pending requests, nr_cpu_ids entries */
+	struct list_head *pending;
+
+	/** Number of requests on the pending lists */
+	unsigned num_pending;
+
+	/** Number of open device files attached to the connection */
+	atomic_t dev_count;
 
 	/** The list of requests being processed */
 	struct list_head processing;
@@ -496,6 +502,9 @@ struct fuse_conn {
 	/** Shortcircuited IO. */
 	unsigned shortcircuit_io:1;
 
+	/** Several requests/replies per device read/write.  Only set in INIT */
+	unsigned batch_io:1;
+
 	/*
 	 * The following bitfields are only for optimization purposes
 	 * and hence races in setting them will not cause malfunction
@@ -567,6 +576,14 @@ struct fuse_conn {
 	/** The number of requests waiting for completion */
 	atomic_t num_waiting;
 
+	/** Bytes read and written through shortcircuit lower files */
+	atomic64_t shortcircuit_read_bytes;
+	atomic64_t shortcircuit_write_bytes;
+
+	/** Bytes read and written by the userspace daemon */
+	atomic64_t daemon_read_bytes;
+	atomic64_t daemon_write_bytes;
+
 	/** Negotiated minor version */
 	unsigned minor;
 
@@ -816,7 +833,7 @@ void fuse_conn_kill(struct fuse_conn *fc);
 /**
  * Initialize fuse_conn
  */
-void fuse_conn_init(struct fuse_conn *fc);
+int fuse_conn_init(struct fuse_conn *fc);
 
 /**
  * Release reference to fuse_conn
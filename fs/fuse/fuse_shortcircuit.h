@@ -28,6 +28,21 @@ ssize_t fuse_shortcircuit_aio_read(struct kiocb *iocb, const struct iovec *iov,
 ssize_t fuse_shortcircuit_aio_write(struct kiocb *iocb, const struct iovec *iov,
 				    unsigned long nr_segs, loff_t pos);
 
+ssize_t fuse_shortcircuit_splice_read(struct file *in, loff_t *ppos,
+				      struct pipe_inode_info *pipe, size_t len,
+				      unsigned int flags);
+
+ssize_t fuse_shortcircuit_splice_write(struct pipe_inode_info *pipe,
+				       struct file *out, loff_t *ppos,
+				       size_t len, unsigned int flags);
+
+int fuse_shortcircuit_mmap(struct file *file, struct vm_area_struct *vma);
+
+int fuse_shortcircuit_fsync(struct file *file, loff_t start, loff_t end,
+			    int datasync);
+
 void fuse_shortcircuit_release(struct fuse_file *ff);
 
+void fuse_account_daemon_io(struct fuse_conn *fc, struct fuse_req *req);
+
 #endif /* _FS_FUSE_SHORCIRCUIT_H */
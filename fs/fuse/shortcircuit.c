@@ -16,6 +16,8 @@
 
 #include <linux/aio.h>
 #include <linux/fs_stack.h>
+#include <linux/mm.h>
+#include <linux/splice.h>
 
 void fuse_setup_shortcircuit(struct fuse_conn *fc, struct fuse_req *req)
 {
@@ -80,6 +82,8 @@ static ssize_t fuse_shortcircuit_aio_read_write(struct kiocb *iocb,
 			fsstack_copy_inode_size(fuse_inode, lower_inode);
 			fsstack_copy_attr_times(fuse_inode, lower_inode);
 		}
+		if (ret_val > 0)
+			atomic64_add(ret_val, &ff->fc->shortcircuit_write_bytes);
 	} else {
 		if (!lower_file->f_op->aio_read)
 			return -EIO;
@@ -87,6 +91,8 @@ static ssize_t fuse_shortcircuit_aio_read_write(struct kiocb *iocb,
 		ret_val = lower_file->f_op->aio_read(iocb, iov, nr_segs, pos);
 		if (ret_val >= 0 || ret_val == -EIOCBQUEUED)
 			fsstack_copy_attr_atime(fuse_inode, lower_inode);
+		if (ret_val > 0)
+			atomic64_add(ret_val, &ff->fc->shortcircuit_read_bytes);
 	}
 
 	iocb->ki_filp = fuse_file;
@@ -108,6 +114,104 @@ ssize_t fuse_shortcircuit_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	return fuse_shortcircuit_aio_read_write(iocb, iov, nr_segs, pos, 1);
 }
 
+ssize_t fuse_shortcircuit_splice_read(struct file *in, loff_t *ppos,
+				      struct pipe_inode_info *pipe, size_t len,
+				      unsigned int flags)
+{
+	struct fuse_file *ff = in->private_data;
+	struct file *lower_file = ff->rw_lower_file;
+	ssize_t ret_val;
+
+	if (!lower_file->f_op->splice_read)
+		return -EINVAL;
+
+	ret_val = lower_file->f_op->splice_read(lower_file, ppos, pipe, len,
+						flags);
+	if (ret_val >= 0)
+		fsstack_copy_attr_atime(file_inode(in), file_inode(lower_file));
+	if (ret_val > 0)
+		atomic64_add(ret_val, &ff->fc->shortcircuit_read_bytes);
+
+	return ret_val;
+}
+
+ssize_t fuse_shortcircuit_splice_write(struct pipe_inode_info *pipe,
+				       struct file *out, loff_t *ppos,
+				       size_t len, unsigned int flags)
+{
+	struct fuse_file *ff = out->private_data;
+	struct file *lower_file = ff->rw_lower_file;
+	struct inode *fuse_inode = file_inode(out);
+	struct inode *lower_inode = file_inode(lower_file);
+	ssize_t ret_val;
+
+	if (!lower_file->f_op->splice_write)
+		return -EINVAL;
+
+	ret_val = lower_file->f_op->splice_write(pipe, lower_file, ppos, len,
+						 flags);
+	if (ret_val >= 0) {
+		fsstack_copy_inode_size(fuse_inode, lower_inode);
+		fsstack_copy_attr_times(fuse_inode, lower_inode);
+	}
+	if (ret_val > 0)
+		atomic64_add(ret_val, &ff->fc->shortcircuit_write_bytes);
+
+	return ret_val;
+}
+
+/*
+ * Map the lower file's pages directly. Reads and writes already go to the
+ * lower file, so its page cache is the only copy of the data and the
+ * mapping stays coherent with them.
+ */
+int fuse_shortcircuit_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *lower_file = ff->rw_lower_file;
+	int ret_val;
+
+	if (!lower_file->f_op->mmap)
+		return -ENODEV;
+
+	if (WARN_ON(file != vma->vm_file))
+		return -EIO;
+
+	vma->vm_file = get_file(lower_file);
+	ret_val = lower_file->f_op->mmap(lower_file, vma);
+	if (ret_val) {
+		/* mmap_region() drops its reference to @file on error */
+		vma->vm_file = file;
+		fput(lower_file);
+		return ret_val;
+	}
+
+	fput(file);
+	file_accessed(file);
+
+	return 0;
+}
+
+int fuse_shortcircuit_fsync(struct file *file, loff_t start, loff_t end,
+			    int datasync)
+{
+	struct fuse_file *ff = file->private_data;
+
+	return vfs_fsync_range(ff->rw_lower_file, start, end, datasync);
+}
+
+/* Count the bytes a FUSE_READ or FUSE_WRITE reply has moved */
+void fuse_account_daemon_io(struct fuse_conn *fc, struct fuse_req *req)
+{
+	if (req->out.h.error)
+		return;
+
+	if (req->in.h.opcode == FUSE_READ)
+		atomic64_add(req->out.args[0].size, &fc->daemon_read_bytes);
+	else if (req->in.h.opcode == FUSE_WRITE)
+		atomic64_add(req->misc.write.out.size, &fc->daemon_write_bytes);
+}
+
 void fuse_shortcircuit_release(struct fuse_file *ff)
 {
 	if (!(ff->rw_lower_file))
@@ -1212,6 +1212,20 @@ const struct file_operations proc_pagemap_operations = {
 #endif /* CONFIG_PROC_PAGE_MONITOR */
 
 #ifdef CONFIG_PROCESS_RECLAIM
+/*
+ * The accessed bits double as a per-process idle tracker: a cold pass
+ * clears them on every page it keeps, so the next cold pass only takes
+ * pages that were not touched in between.
+ */
+static bool reclaim_page_cold(struct vm_area_struct *vma, unsigned long addr,
+			      pte_t *pte, struct page *page)
+{
+	if (ptep_test_and_clear_young(vma, addr, pte))
+		return false;
+
+	return !TestClearPageReferenced(page);
+}
+
 static int reclaim_pte_range(pmd_t *pmd, unsigned long addr,
 				unsigned long end, struct mm_walk *walk)
 {
@@ -1239,6 +1253,9 @@ cont:
 		if (!page)
 			continue;
 
+		if (rp->cold && !reclaim_page_cold(vma, addr, pte, page))
+			continue;
+
 		if (isolate_lru_page(page))
 			continue;
 
@@ -1247,8 +1264,12 @@ cont:
 				page_is_file_cache(page));
 		isolated++;
 		rp->nr_scanned++;
-		if ((isolated >= SWAP_CLUSTER_MAX) || !rp->nr_to_reclaim)
+		if (isolated >= SWAP_CLUSTER_MAX ||
+		    isolated >= rp->nr_to_reclaim) {
+			pte++;
+			addr += PAGE_SIZE;
 			break;
+		}
 	}
 	pte_unmap_unlock(pte - 1, ptl);
 	reclaimed = reclaim_pages_from_list(&page_list, vma);
@@ -1281,6 +1302,7 @@ struct reclaim_param reclaim_task_anon(struct task_struct *task,
 
 	rp.nr_reclaimed = 0;
 	rp.nr_scanned = 0;
+	rp.cold = false;
 	get_task_struct(task);
 	mm = get_task_mm(task);
 	if (!mm)
@@ -1325,9 +1347,12 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 	struct vm_area_struct *vma;
 	enum reclaim_type type;
 	char *type_buf;
+	char *token;
 	struct mm_walk reclaim_walk = {};
 	unsigned long start = 0;
 	unsigned long end = 0;
+	unsigned long long budget = 0;
+	bool cold = false;
 	struct reclaim_param rp;
 
 	memset(buffer, 0, sizeof(buffer));
@@ -1338,23 +1363,21 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 		return -EFAULT;
 
 	type_buf = strstrip(buffer);
-	if (!strcmp(type_buf, "file"))
+	token = strsep(&type_buf, " ");
+	if (!strcmp(token, "file"))
 		type = RECLAIM_FILE;
-	else if (!strcmp(type_buf, "anon"))
+	else if (!strcmp(token, "anon"))
 		type = RECLAIM_ANON;
-	else if (!strcmp(type_buf, "all"))
+	else if (!strcmp(token, "all"))
 		type = RECLAIM_ALL;
-	else if (isdigit(*type_buf))
+	else if (isdigit(*token))
 		type = RECLAIM_RANGE;
 	else
 		goto out_err;
 
 	if (type == RECLAIM_RANGE) {
-		char *token;
 		unsigned long long len, len_in, tmp;
-		token = strsep(&type_buf, " ");
-		if (!token)
-			goto out_err;
+
 		tmp = memparse(token, &token);
 		if (tmp & ~PAGE_MASK || tmp > ULONG_MAX)
 			goto out_err;
@@ -1379,6 +1402,20 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 			goto out_err;
 	}
 
+	while ((token = strsep(&type_buf, " ")) != NULL) {
+		if (!*token)
+			continue;
+		if (!strcmp(token, "cold")) {
+			cold = true;
+		} else if (!strncmp(token, "budget=", 7)) {
+			budget = memparse(token + 7, &token);
+			if (*token || !budget)
+				goto out_err;
+		} else {
+			goto out_err;
+		}
+	}
+
 	task = get_proc_task(file->f_path.dentry->d_inode);
 	if (!task)
 		return -ESRCH;
@@ -1390,15 +1427,19 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 	reclaim_walk.mm = mm;
 	reclaim_walk.pmd_entry = reclaim_pte_range;
 
-	rp.nr_to_reclaim = ~0;
+	rp.nr_to_reclaim = INT_MAX;
+	if (budget)
+		rp.nr_to_reclaim = min_t(unsigned long long, INT_MAX,
+					 DIV_ROUND_UP(budget, PAGE_SIZE));
 	rp.nr_reclaimed = 0;
+	rp.nr_scanned = 0;
+	rp.cold = cold;
 	reclaim_walk.private = &rp;
 
 	down_read(&mm->mmap_sem);
 	if (type == RECLAIM_RANGE) {
-		vma = find_vma(mm, start);
-		while (vma) {
-			if (vma->vm_start > end)
+		for (vma = find_vma(mm, start); vma; vma = vma->vm_next) {
+			if (vma->vm_start >= end || !rp.nr_to_reclaim)
 				break;
 			if (is_vm_hugetlb_page(vma))
 				continue;
@@ -1407,10 +1448,12 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 			walk_page_range(max(vma->vm_start, start),
 					min(vma->vm_end, end),
 					&reclaim_walk);
-			vma = vma->vm_next;
 		}
 	} else {
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
+			if (!rp.nr_to_reclaim)
+				break;
+
 			if (is_vm_hugetlb_page(vma))
 				continue;
 
@@ -95,6 +95,12 @@ static int sdcardfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 		spin_unlock(&lower_dentry->d_lock);
 	}
 
+	/* the package list changed since the permissions were derived */
+	if (err == 1 && dentry->d_inode &&
+	    derived_perm_stale(dentry->d_inode,
+			       atomic_read(&sdcardfs_packagelist_gen)))
+		refresh_derived_permission(dentry);
+
 out:
 	dput(parent_dentry);
 	dput(lower_cur_parent_dentry);
@@ -47,6 +47,7 @@ void setup_derived_state(struct inode *inode, perm_t perm, userid_t userid,
 	info->under_android = under_android;
 	info->under_cache = false;
 	info->under_obb = false;
+	info->perm_gen = atomic_read(&sdcardfs_packagelist_gen);
 	set_top(info, top);
 }
 
@@ -72,6 +73,14 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, co
 
 	inherit_derived_state(parent->d_inode, dentry->d_inode);
 
+	/* Sample the generation before reading the package list, so that a
+	 * concurrent change leaves this state marked stale. A state inherited
+	 * from a stale parent is stale as well. */
+	info->perm_gen = atomic_read(&sdcardfs_packagelist_gen);
+	smp_rmb();
+	if (!IS_ROOT(parent) && derived_perm_stale(parent->d_inode, info->perm_gen))
+		info->perm_gen = parent_info->perm_gen;
+
 	/* Files don't get special labels */
 	if (!S_ISDIR(dentry->d_inode->i_mode))
 		return;
@@ -117,8 +126,8 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, co
 		case PERM_ANDROID_DATA:
 		case PERM_ANDROID_MEDIA:
 			info->perm = PERM_ANDROID_PACKAGE;
-			appid = get_appid(name->name);
-			if (appid != 0 && !is_excluded(name->name, parent_info->userid)) {
+			appid = get_appid_qstr(name);
+			if (appid != 0 && !is_excluded_qstr(name, parent_info->userid)) {
 				info->d_uid = multiuser_get_uid(parent_info->userid, appid);
 			}
 			set_top(info, &info->vfs_inode);
@@ -239,61 +248,34 @@ void fixup_lower_ownership(struct dentry* dentry, const char *name) {
 	sdcardfs_put_lower_path(dentry, &path);
 }
 
-static int descendant_may_need_fixup(struct sdcardfs_inode_info *info, struct limit_search *limit) {
-	if (info->perm == PERM_ROOT)
-		return (limit->flags & BY_USERID)?info->userid == limit->userid:1;
-	if (info->perm == PERM_PRE_ROOT || info->perm == PERM_ANDROID)
-		return 1;
-	return 0;
-}
-
-static int needs_fixup(perm_t perm) {
-	if (perm == PERM_ANDROID_DATA || perm == PERM_ANDROID_OBB
-			|| perm == PERM_ANDROID_MEDIA)
-		return 1;
-	return 0;
-}
-
-static void __fixup_perms_recursive(struct dentry *dentry, struct limit_search *limit, int depth) {
-	struct dentry *child;
-	struct sdcardfs_inode_info *info;
-
-	/*
-	 * All paths will terminate their recursion on hitting PERM_ANDROID_OBB,
-	 * PERM_ANDROID_MEDIA, or PERM_ANDROID_DATA. This happens at a depth of
-	 * at most 3.
-	 */
-	WARN(depth > 3, "%s: Max expected depth exceeded!\n", __func__);
-	spin_lock_nested(&dentry->d_lock, depth);
-	if (!dentry->d_inode) {
-		spin_unlock(&dentry->d_lock);
-		return;
-	}
-	info = SDCARDFS_I(dentry->d_inode);
-
-	if (needs_fixup(info->perm)) {
-		list_for_each_entry(child, &dentry->d_subdirs, d_child) {
-			spin_lock_nested(&child->d_lock, depth + 1);
-			if (!(limit->flags & BY_NAME) || qstr_case_eq(&child->d_name, &limit->name)) {
-				if (child->d_inode) {
-					get_derived_permission(dentry, child);
-					fixup_tmp_permissions(child->d_inode);
-					spin_unlock(&child->d_lock);
-					break;
-				}
-			}
-			spin_unlock(&child->d_lock);
-		}
-	} else 	if (descendant_may_need_fixup(info, limit)) {
-		list_for_each_entry(child, &dentry->d_subdirs, d_child) {
-				__fixup_perms_recursive(child, limit, depth + 1);
+/*
+ * Package list changes only bump sdcardfs_packagelist_gen; the derived state
+ * of a cached dentry is brought up to date here, from d_revalidate, the next
+ * time it is looked up. Stale ancestors are refreshed first, top down, so
+ * that nothing inherits from an out of date parent even when the lookup did
+ * not start at the root.
+ */
+void refresh_derived_permission(struct dentry *dentry)
+{
+	struct dentry *parent, *d;
+	int gen = atomic_read(&sdcardfs_packagelist_gen);
+
+	for (;;) {
+		d = dget(dentry);
+		parent = dget_parent(d);
+		while (!IS_ROOT(parent) && derived_perm_stale(parent->d_inode, gen)) {
+			dput(d);
+			d = parent;
+			parent = dget_parent(d);
 		}
-	}
-	spin_unlock(&dentry->d_lock);
-}
 
-void fixup_perms_recursive(struct dentry *dentry, struct limit_search *limit) {
-	__fixup_perms_recursive(dentry, limit, 0);
+		get_derived_permission(parent, d);
+		fixup_tmp_permissions(d->d_inode);
+		dput(parent);
+		dput(d);
+		if (d == dentry)
+			break;
+	}
 }
 
 /* main function for updating derived permission */
@@ -42,6 +42,8 @@ static DEFINE_HASHTABLE(package_to_appid, 8);
 static DEFINE_HASHTABLE(package_to_userid, 8);
 static DEFINE_HASHTABLE(ext_to_groupid, 8);
 
+/* bumped on every change that may alter a derived permission */
+atomic_t sdcardfs_packagelist_gen = ATOMIC_INIT(0);
 
 static struct kmem_cache *hashtable_entry_cachep;
 
@@ -91,6 +93,12 @@ appid_t get_appid(const char *key)
 	return __get_appid(&q);
 }
 
+/* @key must carry a case insensitive hash, like sdcardfs dentry names do */
+appid_t get_appid_qstr(const struct qstr *key)
+{
+	return __get_appid(key);
+}
+
 static appid_t __get_ext_gid(const struct qstr *key)
 {
 	struct hashtable_entry *hash_cur;
@@ -140,6 +148,11 @@ appid_t is_excluded(const char *key, userid_t user)
 	return __is_excluded(&q, user);
 }
 
+appid_t is_excluded_qstr(const struct qstr *key, userid_t user)
+{
+	return __is_excluded(key, user);
+}
+
 /* Kernel has already enforced everything we returned through
  * derive_permissions_locked(), so this is used to lock down access
  * even further, such as enforcing that apps hold sdcard_rw. */
@@ -255,44 +268,14 @@ static int insert_userid_exclude_entry_locked(const struct qstr *key, userid_t v
 	return 0;
 }
 
-static void fixup_all_perms_name(const struct qstr *key)
-{
-	struct sdcardfs_sb_info *sbinfo;
-	struct limit_search limit = {
-		.flags = BY_NAME,
-		.name = QSTR_INIT(key->name, key->len),
-	};
-	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
-		if (sbinfo_has_sdcard_magic(sbinfo))
-			fixup_perms_recursive(sbinfo->sb->s_root, &limit);
-	}
-}
-
-static void fixup_all_perms_name_userid(const struct qstr *key, userid_t userid)
-{
-	struct sdcardfs_sb_info *sbinfo;
-	struct limit_search limit = {
-		.flags = BY_NAME | BY_USERID,
-		.name = QSTR_INIT(key->name, key->len),
-		.userid = userid,
-	};
-	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
-		if (sbinfo_has_sdcard_magic(sbinfo))
-			fixup_perms_recursive(sbinfo->sb->s_root, &limit);
-	}
-}
-
-static void fixup_all_perms_userid(userid_t userid)
+/*
+ * Invalidate every derived permission that may depend on the package list.
+ * Nothing is walked here; see refresh_derived_permission().
+ */
+static void packagelist_changed(void)
 {
-	struct sdcardfs_sb_info *sbinfo;
-	struct limit_search limit = {
-		.flags = BY_USERID,
-		.userid = userid,
-	};
-	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
-		if (sbinfo_has_sdcard_magic(sbinfo))
-			fixup_perms_recursive(sbinfo->sb->s_root, &limit);
-	}
+	smp_mb__before_atomic_inc();
+	atomic_inc(&sdcardfs_packagelist_gen);
 }
 
 static int insert_packagelist_entry(const struct qstr *key, appid_t value)
@@ -302,7 +285,7 @@ static int insert_packagelist_entry(const struct qstr *key, appid_t value)
 	mutex_lock(&sdcardfs_super_list_lock);
 	err = insert_packagelist_appid_entry_locked(key, value);
 	if (!err)
-		fixup_all_perms_name(key);
+		packagelist_changed();
 	mutex_unlock(&sdcardfs_super_list_lock);
 
 	return err;
@@ -326,7 +309,7 @@ static int insert_userid_exclude_entry(const struct qstr *key, userid_t value)
 	mutex_lock(&sdcardfs_super_list_lock);
 	err = insert_userid_exclude_entry_locked(key, value);
 	if (!err)
-		fixup_all_perms_name_userid(key, value);
+		packagelist_changed();
 	mutex_unlock(&sdcardfs_super_list_lock);
 
 	return err;
@@ -367,7 +350,7 @@ static void remove_packagelist_entry(const struct qstr *key)
 {
 	mutex_lock(&sdcardfs_super_list_lock);
 	remove_packagelist_entry_locked(key);
-	fixup_all_perms_name(key);
+	packagelist_changed();
 	mutex_unlock(&sdcardfs_super_list_lock);
 	return;
 }
@@ -418,7 +401,7 @@ static void remove_userid_all_entry(userid_t userid)
 {
 	mutex_lock(&sdcardfs_super_list_lock);
 	remove_userid_all_entry_locked(userid);
-	fixup_all_perms_userid(userid);
+	packagelist_changed();
 	mutex_unlock(&sdcardfs_super_list_lock);
 	return;
 }
@@ -443,7 +426,7 @@ static void remove_userid_exclude_entry(const struct qstr *key, userid_t userid)
 {
 	mutex_lock(&sdcardfs_super_list_lock);
 	remove_userid_exclude_entry_locked(key, userid);
-	fixup_all_perms_name_userid(key, userid);
+	packagelist_changed();
 	mutex_unlock(&sdcardfs_super_list_lock);
 	return;
 }
@@ -188,6 +188,8 @@ struct sdcardfs_inode_info {
 	bool under_obb;
 	/* top folder for ownership */
 	struct inode *top;
+	/* sdcardfs_packagelist_gen the state above was derived at */
+	int perm_gen;
 
 	struct inode vfs_inode;
 };
@@ -457,28 +459,30 @@ extern struct mutex sdcardfs_super_list_lock;
 extern struct list_head sdcardfs_super_list;
 
 /* for packagelist.c */
+extern atomic_t sdcardfs_packagelist_gen;
 extern appid_t get_appid(const char *app_name);
+extern appid_t get_appid_qstr(const struct qstr *app_name);
 extern appid_t get_ext_gid(const char *app_name);
 extern appid_t is_excluded(const char *app_name, userid_t userid);
+extern appid_t is_excluded_qstr(const struct qstr *app_name, userid_t userid);
 extern int check_caller_access_to_name(struct inode *parent_node, const struct qstr* name);
 extern int open_flags_to_access_mode(int open_flags);
 extern int packagelist_init(void);
 extern void packagelist_exit(void);
 
 /* for derived_perm.c */
-#define BY_NAME		(1 << 0)
-#define BY_USERID	(1 << 1)
-struct limit_search {
-	unsigned int flags;
-	struct qstr name;
-	userid_t userid;
-};
+
+/* Was @inode's derived state computed before package list generation @gen? */
+static inline bool derived_perm_stale(struct inode *inode, int gen)
+{
+	return SDCARDFS_I(inode)->perm_gen - gen < 0;
+}
 
 extern void setup_derived_state(struct inode *inode, perm_t perm, userid_t userid,
 			uid_t uid, bool under_android, struct inode *top);
 extern void get_derived_permission(struct dentry *parent, struct dentry *dentry);
 extern void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, const struct qstr *name);
-extern void fixup_perms_recursive(struct dentry *dentry, struct limit_search *limit);
+extern void refresh_derived_permission(struct dentry *dentry);
 
 extern void update_derived_permission_lock(struct dentry *dentry);
 void fixup_lower_ownership(struct dentry* dentry, const char *name);
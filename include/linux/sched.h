@@ -168,8 +168,18 @@ extern unsigned long nr_iowait(void);
 extern unsigned long nr_iowait_cpu(int cpu);
 extern unsigned long this_cpu_load(void);
 
+/* A caller's position in the nr_running averages, see sched_avg.c */
+struct sched_nr_snapshot {
+	u64 time;
+	u64 nr_sum, nr_big_sum, iowait_sum;
+};
+
 extern void sched_update_nr_prod(int cpu, long delta, bool inc);
 extern void sched_get_nr_running_avg(int *avg, int *iowait_avg, int *big_avg);
+extern void sched_get_nr_running_avg_cpus(const struct cpumask *cpus,
+					  struct sched_nr_snapshot *snap,
+					  int *avg, int *iowait_avg,
+					  int *big_avg);
 
 extern void calc_global_load(unsigned long ticks);
 extern void update_cpu_load_nohz(void);
@@ -1059,6 +1069,7 @@ struct sched_statistics {
 #endif
 
 #define RAVG_HIST_SIZE_MAX  5
+#define NUM_BUSY_BUCKETS  10
 
 /* ravg represents frequency scaled cpu-demand of tasks */
 struct ravg {
@@ -1083,12 +1094,23 @@ struct ravg {
 	 *
 	 * 'prev_window' represents task's contribution to cpu busy time
 	 * statistics (rq->prev_runnable_sum) in previous window
+	 *
+	 * 'busy_buckets' is a histogram of the busy time of recent windows,
+	 * in NUM_BUSY_BUCKETS equal slices of the window, weighted towards
+	 * the windows seen most often and most recently
+	 *
+	 * 'pred_demand' is the busy time predicted for the task's next
+	 * window from 'busy_buckets', raised as the current window goes past
+	 * it. It lets frequency ramp up when a bursty task starts its burst
+	 * rather than a window later.
 	 */
 	u64 mark_start;
 	u32 sum, demand;
 	u32 sum_history[RAVG_HIST_SIZE_MAX];
 #ifdef CONFIG_SCHED_FREQ_INPUT
 	u32 curr_window, prev_window;
+	u32 pred_demand;
+	u8 busy_buckets[NUM_BUSY_BUCKETS];
 #endif
 };
 
@@ -1818,6 +1840,25 @@ extern int task_free_unregister(struct notifier_block *n);
 extern int sched_set_window(u64 window_start, unsigned int window_size);
 extern unsigned long sched_get_busy(int cpu);
 extern void sched_set_io_is_busy(int val);
+
+/* Why the scheduler is asking a hooked governor to reevaluate */
+#define SCHED_CPUFREQ_WINDOW	(1U << 0)	/* window rolled over */
+#define SCHED_CPUFREQ_ALERT	(1U << 1)	/* migration or wakeup */
+
+struct update_util_data {
+	void (*func)(struct update_util_data *data, u64 time,
+		     unsigned int flags);
+};
+
+extern void cpufreq_add_update_util_hook(int cpu,
+		struct update_util_data *data,
+		void (*func)(struct update_util_data *data, u64 time,
+			     unsigned int flags));
+extern void cpufreq_remove_update_util_hook(int cpu);
+extern void sched_get_cpu_util(int cpu, unsigned long *util,
+			       unsigned long *max);
+extern void sched_update_cur_freq(int cpu, unsigned int new_freq);
+extern void sched_set_freq_floor(int cpu, unsigned int freq);
 #else
 static inline int sched_set_window(u64 window_start, unsigned int window_size)
 {
@@ -1828,6 +1869,7 @@ static inline unsigned long sched_get_busy(int cpu)
 	return 0;
 }
 static inline void sched_set_io_is_busy(int val) {};
+static inline void sched_set_freq_floor(int cpu, unsigned int freq) { }
 #endif
 
 /*
@@ -2015,8 +2057,13 @@ sched_set_cpu_cstate(int cpu, int cstate, int wakeup_energy, int wakeup_latency)
 
 extern int sched_set_wake_up_idle(struct task_struct *p, int wake_up_idle);
 extern u32 sched_get_wake_up_idle(struct task_struct *p);
+extern int sched_isolate_cpu(int cpu);
+extern int sched_unisolate_cpu(int cpu);
 extern int sched_set_group_id(struct task_struct *p, unsigned int group_id);
 extern unsigned int sched_get_group_id(struct task_struct *p);
+extern int sched_set_group_frame(struct task_struct *p, u64 budget_ns);
+struct seq_file;
+extern int sched_show_group_frame(struct seq_file *m, struct task_struct *p);
 
 #ifdef CONFIG_SCHED_HMP
 
@@ -46,6 +46,7 @@ extern unsigned int sysctl_sched_migration_fixup;
 extern unsigned int sysctl_sched_heavy_task_pct;
 extern unsigned int sysctl_sched_min_runtime;
 extern unsigned int sysctl_sched_enable_power_aware;
+extern unsigned int sysctl_sched_enable_energy_aware;
 extern unsigned int sysctl_sched_enable_colocation;
 extern unsigned int sysctl_sched_enable_thread_grouping;
 
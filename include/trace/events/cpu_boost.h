@@ -0,0 +1,54 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpu_boost
+
+#if !defined(_TRACE_CPU_BOOST_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CPU_BOOST_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cpu_boost_start,
+
+	TP_PROTO(const char *name, unsigned int duration_ms, int holds),
+
+	TP_ARGS(name, duration_ms, holds),
+
+	TP_STRUCT__entry(
+		__string(	name,		name		)
+		__field(	unsigned int,	duration_ms	)
+		__field(	int,		holds		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->duration_ms	= duration_ms;
+		__entry->holds		= holds;
+	),
+
+	TP_printk("profile=%s duration_ms=%u holds=%d",
+		__get_str(name), __entry->duration_ms, __entry->holds)
+);
+
+TRACE_EVENT(cpu_boost_end,
+
+	TP_PROTO(const char *name, u64 residency_us),
+
+	TP_ARGS(name, residency_us),
+
+	TP_STRUCT__entry(
+		__string(	name,		name		)
+		__field(	u64,		residency_us	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->residency_us	= residency_us;
+	),
+
+	TP_printk("profile=%s residency_us=%llu",
+		__get_str(name), __entry->residency_us)
+);
+
+#endif /* _TRACE_CPU_BOOST_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
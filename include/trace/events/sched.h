@@ -117,6 +117,33 @@ TRACE_EVENT(sched_enq_deq_task,
 
 #ifdef CONFIG_SCHED_HMP
 
+TRACE_EVENT(sched_energy_diff,
+
+	TP_PROTO(struct task_struct *p, int cpu, u64 tload, s64 delta),
+
+	TP_ARGS(p, cpu, tload, delta),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	cpu			)
+		__field(	u64,	tload			)
+		__field(	s64,	delta			)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid		= p->pid;
+		__entry->cpu		= cpu;
+		__entry->tload		= tload;
+		__entry->delta		= delta;
+	),
+
+	TP_printk("%d (%s): cpu=%d tload=%llu energy_delta=%lld",
+		__entry->pid, __entry->comm, __entry->cpu,
+		__entry->tload, __entry->delta)
+);
+
 TRACE_EVENT(sched_task_load,
 
 	TP_PROTO(struct task_struct *p, int small_task, int boost, int reason,
@@ -184,6 +211,36 @@ TRACE_EVENT(sched_set_preferred_cluster,
 			__entry->cluster_first_cpu)
 );
 
+TRACE_EVENT(sched_group_frame,
+
+	TP_PROTO(struct related_thread_group *grp, u64 elapsed, int missed),
+
+	TP_ARGS(grp, elapsed, missed),
+
+	TP_STRUCT__entry(
+		__field(		int,	id			)
+		__field(		u64,	elapsed			)
+		__field(		int,	missed			)
+		__field(		int,	boosted			)
+		__field(	unsigned int,	nr_frames		)
+		__field(	unsigned int,	nr_missed_frames	)
+	),
+
+	TP_fast_assign(
+		__entry->id			= grp->id;
+		__entry->elapsed		= elapsed;
+		__entry->missed			= missed;
+		__entry->boosted		= !!grp->boost_cluster;
+		__entry->nr_frames		= grp->nr_frames;
+		__entry->nr_missed_frames	= grp->nr_missed_frames;
+	),
+
+	TP_printk("group_id %d elapsed %llu missed %d boosted %d frames %u missed_frames %u",
+			__entry->id, __entry->elapsed, __entry->missed,
+			__entry->boosted, __entry->nr_frames,
+			__entry->nr_missed_frames)
+);
+
 TRACE_EVENT(sched_cpu_load,
 
 	TP_PROTO(struct rq *rq, int idle, int mostly_idle, u64 irqload,
@@ -402,6 +459,42 @@ TRACE_EVENT(sched_reset_all_window_stats,
 
 #ifdef CONFIG_SCHED_FREQ_INPUT
 
+TRACE_EVENT(sched_update_pred_demand,
+
+	TP_PROTO(struct rq *rq, struct task_struct *p, u32 runtime,
+		 unsigned int pred_demand),
+
+	TP_ARGS(rq, p, runtime, pred_demand),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,   TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(unsigned int,	runtime			)
+		__field(unsigned int,	pred_demand		)
+		__array(	u8,	bucket, NUM_BUSY_BUCKETS)
+		__field(	int,	cpu			)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid            = p->pid;
+		__entry->runtime        = runtime;
+		__entry->pred_demand    = pred_demand;
+		memcpy(__entry->bucket, p->ravg.busy_buckets,
+					NUM_BUSY_BUCKETS * sizeof(u8));
+		__entry->cpu            = rq->cpu;
+	),
+
+	TP_printk("%d (%s): runtime %u pred_demand %u (buckets: %u %u %u %u %u %u %u %u %u %u) cpu %d",
+		__entry->pid, __entry->comm,
+		__entry->runtime, __entry->pred_demand,
+		__entry->bucket[0], __entry->bucket[1],
+		__entry->bucket[2], __entry->bucket[3],
+		__entry->bucket[4], __entry->bucket[5],
+		__entry->bucket[6], __entry->bucket[7],
+		__entry->bucket[8], __entry->bucket[9], __entry->cpu)
+);
+
 TRACE_EVENT(sched_migration_update_sum,
 
 	TP_PROTO(struct rq *rq, struct task_struct *p),
@@ -413,17 +506,22 @@ TRACE_EVENT(sched_migration_update_sum,
 		__field(int,		pid			)
 		__field(	u64,	cs			)
 		__field(	u64,	ps			)
+		__field(	u32,	curr_top		)
+		__field(	u32,	prev_top		)
 	),
 
 	TP_fast_assign(
 		__entry->cpu		= cpu_of(rq);
 		__entry->cs		= rq->curr_runnable_sum;
 		__entry->ps		= rq->prev_runnable_sum;
+		__entry->curr_top	= rq->curr_top;
+		__entry->prev_top	= rq->prev_top;
 		__entry->pid		= p->pid;
 	),
 
-	TP_printk("cpu %d: cs %llu ps %llu pid %d", __entry->cpu,
-		      __entry->cs, __entry->ps, __entry->pid)
+	TP_printk("cpu %d: cs %llu ps %llu curr_top %u prev_top %u pid %d",
+		      __entry->cpu, __entry->cs, __entry->ps,
+		      __entry->curr_top, __entry->prev_top, __entry->pid)
 );
 
 TRACE_EVENT(sched_get_busy,
@@ -468,6 +566,25 @@ TRACE_EVENT(sched_freq_alert,
 		__entry->cpu, __entry->old_load, __entry->new_load)
 );
 
+TRACE_EVENT(sched_freq_floor,
+
+	TP_PROTO(int cpu, unsigned int freq),
+
+	TP_ARGS(cpu, freq),
+
+	TP_STRUCT__entry(
+		__field(	int,		cpu		)
+		__field(	unsigned int,	freq		)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->freq		= freq;
+	),
+
+	TP_printk("cpu %d freq_floor=%u", __entry->cpu, __entry->freq)
+);
+
 #endif	/* CONFIG_SCHED_FREQ_INPUT */
 
 #endif	/* CONFIG_SCHED_HMP */
@@ -976,6 +1093,56 @@ TRACE_EVENT(sched_get_nr_running_avg,
 		__entry->avg, __entry->big_avg, __entry->iowait_avg)
 );
 
+TRACE_EVENT(sched_isolate,
+
+	TP_PROTO(unsigned int cpu, int isolated, unsigned long isolated_cpus),
+
+	TP_ARGS(cpu, isolated, isolated_cpus),
+
+	TP_STRUCT__entry(
+		__field( u32,		cpu			)
+		__field( int,		isolated		)
+		__field( unsigned long,	isolated_cpus		)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->isolated	= isolated;
+		__entry->isolated_cpus	= isolated_cpus;
+	),
+
+	TP_printk("cpu=%u isolated=%d isolated_cpus=0x%lx",
+		__entry->cpu, __entry->isolated, __entry->isolated_cpus)
+);
+
+TRACE_EVENT(core_ctl_eval_need,
+
+	TP_PROTO(unsigned int cpu, unsigned int nr_avg, unsigned int busy_cpus,
+		 unsigned int old_need, unsigned int new_need),
+
+	TP_ARGS(cpu, nr_avg, busy_cpus, old_need, new_need),
+
+	TP_STRUCT__entry(
+		__field( u32,	cpu			)
+		__field( u32,	nr_avg			)
+		__field( u32,	busy_cpus		)
+		__field( u32,	old_need		)
+		__field( u32,	new_need		)
+	),
+
+	TP_fast_assign(
+		__entry->cpu		= cpu;
+		__entry->nr_avg		= nr_avg;
+		__entry->busy_cpus	= busy_cpus;
+		__entry->old_need	= old_need;
+		__entry->new_need	= new_need;
+	),
+
+	TP_printk("cpu=%u nr_avg=%u busy_cpus=%u old_need=%u new_need=%u",
+		__entry->cpu, __entry->nr_avg, __entry->busy_cpus,
+		__entry->old_need, __entry->new_need)
+);
+
 #endif /* _TRACE_SCHED_H */
 
 /* This part must be outside protection */
@@ -629,6 +629,9 @@ static int _get_nohz_timer_target_hmp(void)
 		int cpu_cost = power_cost_at_freq(i, cpu_max_possible_freq(i));
 		int cstate = rq->cstate;
 
+		if (cpu_isolated(i))
+			continue;
+
 		if (power_delta_exceeded(cpu_cost, min_cost)) {
 			if (cpu_cost > min_cost)
 				continue;
@@ -682,18 +685,28 @@ int get_nohz_timer_target(void)
 			return lower_power_cpu;
 	}
 
-	if (!idle_cpu(cpu))
+	if (!idle_cpu(cpu) && !cpu_isolated(cpu))
 		return cpu;
 
 	rcu_read_lock();
 	for_each_domain(cpu, sd) {
 		for_each_cpu(i, sched_domain_span(sd)) {
-			if (!idle_cpu(i)) {
+			if (!idle_cpu(i) && !cpu_isolated(i)) {
 				cpu = i;
 				goto unlock;
 			}
 		}
 	}
+
+	/* Keep unpinned timers off isolated CPUs */
+	if (cpu_isolated(cpu)) {
+		for_each_online_cpu(i) {
+			if (!cpu_isolated(i)) {
+				cpu = i;
+				break;
+			}
+		}
+	}
 unlock:
 	rcu_read_unlock();
 	return cpu;
@@ -1260,6 +1273,7 @@ static void add_cluster(struct cpufreq_policy *policy)
 	cluster->min_freq = policy->min;
 	cluster->max_possible_freq = policy->cpuinfo.max_freq;
 	cluster->efficiency = arch_get_cpu_efficiency(cpu);
+	cluster->energy = sched_energy_parse(cpu);
 
 	if (cluster->efficiency > max_possible_efficiency)
 		max_possible_efficiency = cluster->efficiency;
@@ -1339,6 +1353,10 @@ static void _set_preferred_cluster(struct related_thread_group *grp)
 			sched_grp_min_cluster_update_delta)
 		return;
 
+	/* A group late for its frame stays on the cluster it was sent to */
+	if (grp->boost_cluster)
+		return;
+
 	list_for_each_entry(p, &grp->tasks, grp_list) {
 		if (is_task_active(p))
 			combined_demand += p->ravg.demand;
@@ -1356,6 +1374,176 @@ static void set_preferred_cluster(struct related_thread_group *grp)
 	raw_spin_unlock(&grp->lock);
 }
 
+/*
+ * Frame-aware groups: a member reports the start of each frame with its
+ * time budget, and the end of the last one. When the frame is projected,
+ * from how long recent frames took, to end past its deadline, the group
+ * is moved to the biggest cluster and that cluster is run at full speed
+ * until the frame ends.
+ */
+#define FRAME_TIME_AVG_SHIFT	2
+
+static inline bool frame_late(struct related_thread_group *grp, u64 now)
+{
+	u64 end = max(now, grp->frame_start + grp->frame_time_avg);
+
+	return end > grp->frame_deadline;
+}
+
+static struct sched_cluster *frame_boost_start(struct related_thread_group *grp)
+{
+	/* Clusters are sorted by power cost, the costliest is the biggest */
+	struct sched_cluster *cluster = sched_cluster[num_clusters - 1];
+
+	grp->boost_cluster = cluster;
+	atomic_inc(&cluster->nr_frame_boost);
+	grp->nr_boosted_frames++;
+
+	if (sysctl_sched_enable_colocation) {
+		grp->preferred_cluster = cluster;
+		trace_sched_set_preferred_cluster(grp, 0);
+	}
+
+	return cluster;
+}
+
+static struct sched_cluster *frame_boost_stop(struct related_thread_group *grp)
+{
+	struct sched_cluster *cluster = grp->boost_cluster;
+
+	atomic_dec(&cluster->nr_frame_boost);
+	grp->boost_cluster = NULL;
+
+	/* Recompute the preference right away, from aggregate demand */
+	grp->last_update = 0;
+	_set_preferred_cluster(grp);
+
+	return cluster;
+}
+
+/* Let the governor see a cluster's boost come or go */
+static void frame_boost_notify(struct sched_cluster *cluster)
+{
+	int cpu;
+
+	for_each_cpu_and(cpu, &cluster->cpus, cpu_online_mask)
+		check_for_freq_change(cpu_rq(cpu));
+}
+
+static void frame_end(struct related_thread_group *grp, u64 now)
+{
+	u64 elapsed = now - grp->frame_start;
+	int missed = now > grp->frame_deadline;
+
+	grp->nr_frames++;
+	if (missed)
+		grp->nr_missed_frames++;
+
+	if (grp->frame_time_avg)
+		grp->frame_time_avg += (elapsed >> FRAME_TIME_AVG_SHIFT) -
+			(grp->frame_time_avg >> FRAME_TIME_AVG_SHIFT);
+	else
+		grp->frame_time_avg = elapsed;
+
+	grp->frame_start = 0;
+	trace_sched_group_frame(grp, elapsed, missed);
+}
+
+/* Called from the tick of a group member */
+void check_frame_deadline(struct related_thread_group *grp)
+{
+	struct sched_cluster *boosted = NULL;
+
+	if (!grp->frame_start || grp->boost_cluster)
+		return;
+
+	raw_spin_lock(&grp->lock);
+	if (grp->frame_start && !grp->boost_cluster &&
+	    frame_late(grp, sched_ktime_clock()))
+		boosted = frame_boost_start(grp);
+	raw_spin_unlock(&grp->lock);
+
+	if (boosted)
+		frame_boost_notify(boosted);
+}
+
+/**
+ * sched_set_group_frame - report a frame boundary for @p's group
+ * @p:		any member of the group
+ * @budget_ns:	time the new frame has until its deadline, or 0 to end
+ *		the current frame without starting another
+ *
+ * Ends the group's current frame, if any, and starts a new one.
+ */
+int sched_set_group_frame(struct task_struct *p, u64 budget_ns)
+{
+	struct sched_cluster *boosted = NULL, *unboosted = NULL;
+	struct related_thread_group *grp;
+	unsigned long flags;
+	u64 now;
+
+	local_irq_save(flags);
+	raw_spin_lock(&p->pi_lock);
+	grp = p->grp;
+	if (!grp) {
+		raw_spin_unlock(&p->pi_lock);
+		local_irq_restore(flags);
+		return -EINVAL;
+	}
+	raw_spin_lock(&grp->lock);
+	raw_spin_unlock(&p->pi_lock);
+
+	now = sched_ktime_clock();
+	if (grp->frame_start)
+		frame_end(grp, now);
+
+	if (budget_ns) {
+		grp->frame_start = now;
+		grp->frame_deadline = now + budget_ns;
+	}
+
+	if (grp->boost_cluster && (!budget_ns || !frame_late(grp, now)))
+		unboosted = frame_boost_stop(grp);
+	else if (!grp->boost_cluster && budget_ns && frame_late(grp, now))
+		boosted = frame_boost_start(grp);
+
+	raw_spin_unlock(&grp->lock);
+	local_irq_restore(flags);
+
+	if (unboosted)
+		frame_boost_notify(unboosted);
+	if (boosted)
+		frame_boost_notify(boosted);
+
+	return 0;
+}
+
+int sched_show_group_frame(struct seq_file *m, struct task_struct *p)
+{
+	struct related_thread_group *grp;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	raw_spin_lock(&p->pi_lock);
+	grp = p->grp;
+	if (!grp) {
+		raw_spin_unlock(&p->pi_lock);
+		local_irq_restore(flags);
+		return -EINVAL;
+	}
+	raw_spin_lock(&grp->lock);
+	raw_spin_unlock(&p->pi_lock);
+
+	seq_printf(m, "frames %u missed %u boosted %u avg_ns %llu\n",
+		   grp->nr_frames, grp->nr_missed_frames,
+		   grp->nr_boosted_frames, grp->frame_time_avg);
+
+	raw_spin_unlock(&grp->lock);
+	local_irq_restore(flags);
+
+	return 0;
+}
+
 struct related_thread_group *alloc_related_thread_group(int group_id)
 {
 	struct related_thread_group *grp;
@@ -1409,6 +1597,9 @@ static void remove_task_from_group(struct task_struct *p)
 	if (!list_empty(&grp->tasks)) {
 		empty_group = 0;
 		_set_preferred_cluster(grp);
+	} else if (grp->boost_cluster) {
+		atomic_dec(&grp->boost_cluster->nr_frame_boost);
+		grp->boost_cluster = NULL;
 	}
 
 	raw_spin_unlock(&grp->lock);
@@ -1828,6 +2019,38 @@ static inline unsigned int load_to_freq(struct rq *rq, u64 load)
 	return freq;
 }
 
+/* Busy time that load_to_freq() turns into @freq */
+static inline u64 freq_to_load(struct rq *rq, unsigned int freq)
+{
+	u64 load = (u64)freq * max_task_load() * 1024;
+
+	return div64_u64(load, (u64)cpu_max_possible_freq(cpu_of(rq)) *
+			       cpu_load_scale_factor(cpu_of(rq)));
+}
+
+/*
+ * The load frequency is picked for: the last window's busy time, unless
+ * the tasks queued here are predicted to need more, or a single task
+ * that moved here needed more on its own.
+ */
+static inline u64 freq_policy_load(struct rq *rq)
+{
+	u64 load = rq->prev_runnable_sum;
+	unsigned int floor = ACCESS_ONCE(rq->freq_floor);
+
+	load = max(load, rq->hmp_stats.pred_demands_sum);
+	load = max_t(u64, load, rq->prev_top);
+
+	/* A group late for its frame needs the cluster at full speed */
+	if (atomic_read(&rq->cluster->nr_frame_boost))
+		load = max_t(u64, load, max_task_load());
+
+	if (floor)
+		load = max(load, freq_to_load(rq, floor));
+
+	return load;
+}
+
 /* Should scheduler alert governor for changing frequency? */
 static int send_notification(struct rq *rq)
 {
@@ -1839,7 +2062,7 @@ static int send_notification(struct rq *rq)
 		return 0;
 
 	cur_freq = load_to_freq(rq, rq->old_busy_time);
-	freq_required = load_to_freq(rq, rq->prev_runnable_sum);
+	freq_required = load_to_freq(rq, freq_policy_load(rq));
 
 	if (nearly_same_freq(cur_freq, freq_required))
 		return 0;
@@ -1854,21 +2077,91 @@ static int send_notification(struct rq *rq)
 	return rc;
 }
 
+DEFINE_PER_CPU(struct update_util_data *, cpufreq_update_util_data);
+
+/**
+ * cpufreq_add_update_util_hook - have the scheduler drive cpufreq on @cpu
+ * @cpu: the CPU whose load changes should be reported
+ * @data: governor data, embedded in the governor's per-cpu structure
+ * @func: callback, invoked with @cpu's rq->lock held and interrupts off
+ *
+ * @func is called whenever @cpu's window stats roll over and whenever
+ * migration or wakeup change its load enough to warrant a frequency
+ * change; it may read the new load with sched_get_cpu_util().
+ */
+void cpufreq_add_update_util_hook(int cpu, struct update_util_data *data,
+		void (*func)(struct update_util_data *data, u64 time,
+			     unsigned int flags))
+{
+	if (WARN_ON(!data || !func))
+		return;
+
+	if (WARN_ON(per_cpu(cpufreq_update_util_data, cpu)))
+		return;
+
+	data->func = func;
+	rcu_assign_pointer(per_cpu(cpufreq_update_util_data, cpu), data);
+}
+
+/*
+ * The callback may still be running on return; callers must wait with
+ * synchronize_sched() before freeing the data it uses.
+ */
+void cpufreq_remove_update_util_hook(int cpu)
+{
+	rcu_assign_pointer(per_cpu(cpufreq_update_util_data, cpu), NULL);
+}
+
 /* Alert governor if there is a need to change frequency */
 void check_for_freq_change(struct rq *rq)
 {
 	int cpu = cpu_of(rq);
+	unsigned long flags;
 
 	if (!send_notification(rq))
 		return;
 
 	trace_sched_freq_alert(cpu, rq->old_busy_time, rq->prev_runnable_sum);
 
+	/*
+	 * A governor hooked into the scheduler acts on the new load right
+	 * away, without calling back into sched_get_busy(), so the alert
+	 * is consumed here and the next one may be sent.
+	 */
+	raw_spin_lock_irqsave(&rq->lock, flags);
+	if (cpufreq_update_util(rq, sched_ktime_clock(), SCHED_CPUFREQ_ALERT))
+		rq->notifier_sent = 0;
+	raw_spin_unlock_irqrestore(&rq->lock, flags);
+
 	atomic_notifier_call_chain(
 		&load_alert_notifier_head, 0,
 		(void *)(long)cpu);
 }
 
+/**
+ * sched_set_freq_floor - keep the load reported for @cpu above @freq
+ * @cpu:	the CPU to boost
+ * @freq:	frequency in KHz, or 0 to drop the floor
+ *
+ * The floor is folded into the busy time governors read with
+ * sched_get_busy() or sched_get_cpu_util(), and the governor is alerted
+ * right away if that moves the frequency it should pick. The policy
+ * limits are left alone. Must not be called with any rq->lock held.
+ */
+void sched_set_freq_floor(int cpu, unsigned int freq)
+{
+	struct rq *rq = cpu_rq(cpu);
+
+	if (rq->freq_floor == freq)
+		return;
+
+	rq->freq_floor = freq;
+	trace_sched_freq_floor(cpu, freq);
+
+	if (cpu_online(cpu))
+		check_for_freq_change(rq);
+}
+
 static int account_busy_for_cpu_time(struct rq *rq, struct task_struct *p,
 				     u64 irqtime, int event)
 {
@@ -2115,6 +2408,174 @@ static void update_cpu_busy_time(struct task_struct *p, struct rq *rq,
 
 	BUG();
 }
+
+/*
+ * Track the busiest task of the rq's current and previous windows. The
+ * maximum only grows within a window: a task migrating away leaves it
+ * overestimated until the window rolls over.
+ */
+static void update_top_task(struct task_struct *p, struct rq *rq,
+			    u64 mark_start)
+{
+	/* The rq's windows roll over with the current task's */
+	if (p == rq->curr && mark_start < rq->window_start) {
+		if (rq->window_start - mark_start < sched_ravg_window)
+			rq->prev_top = rq->curr_top;
+		else
+			rq->prev_top = 0;
+		rq->curr_top = 0;
+	}
+
+	if (is_idle_task(p) || exiting_task(p))
+		return;
+
+	rq->curr_top = max(rq->curr_top, p->ravg.curr_window);
+	rq->prev_top = max(rq->prev_top, p->ravg.prev_window);
+}
+
+/*
+ * Busy time histogram tuning: a bucket hit gains INC_STEP, or
+ * INC_STEP_BIG once it has been hit consistently, while all other
+ * buckets decay by DEC_STEP.
+ */
+#define INC_STEP		8
+#define INC_STEP_BIG		16
+#define DEC_STEP		2
+#define CONSISTENT_THRES	16
+
+static inline int busy_to_bucket(u32 normalized_rt)
+{
+	int bidx;
+
+	bidx = mult_frac(normalized_rt, NUM_BUSY_BUCKETS, max_task_load());
+	bidx = min(bidx, NUM_BUSY_BUCKETS - 1);
+
+	/*
+	 * Combine the lowest two buckets: even the lowest frequency is
+	 * enough for both, so telling them apart is not useful.
+	 */
+	if (!bidx)
+		bidx++;
+
+	return bidx;
+}
+
+static inline void bucket_increase(u8 *buckets, int idx)
+{
+	int i, step;
+
+	for (i = 0; i < NUM_BUSY_BUCKETS; i++) {
+		if (idx != i) {
+			if (buckets[i] > DEC_STEP)
+				buckets[i] -= DEC_STEP;
+			else
+				buckets[i] = 0;
+		} else {
+			step = buckets[i] >= CONSISTENT_THRES ?
+						INC_STEP_BIG : INC_STEP;
+			if (buckets[i] > U8_MAX - step)
+				buckets[i] = U8_MAX;
+			else
+				buckets[i] += step;
+		}
+	}
+}
+
+/*
+ * Predict the busy time of @p's next window: the lowest bucket at or
+ * above @start that the task has hit recently. Within that bucket, pick
+ * the latest runtime in the task's history that falls into it, or the
+ * middle of the bucket if there is none. The prediction is never below
+ * @runtime.
+ */
+static u32 get_pred_busy(struct rq *rq, struct task_struct *p,
+			 int start, u32 runtime)
+{
+	u8 *buckets = p->ravg.busy_buckets;
+	u32 *hist = p->ravg.sum_history;
+	u32 dmin, dmax, ret = runtime;
+	int i, first = NUM_BUSY_BUCKETS;
+
+	for (i = start; i < NUM_BUSY_BUCKETS; i++) {
+		if (buckets[i]) {
+			first = i;
+			break;
+		}
+	}
+
+	/* nothing above runtime was seen lately, predict runtime */
+	if (first >= NUM_BUSY_BUCKETS)
+		goto out;
+
+	/* the lowest two buckets are combined */
+	if (first < 2) {
+		dmin = 0;
+		first = 1;
+	} else {
+		dmin = mult_frac(first, max_task_load(), NUM_BUSY_BUCKETS);
+	}
+	dmax = mult_frac(first + 1, max_task_load(), NUM_BUSY_BUCKETS);
+
+	for (i = 0; i < sched_ravg_hist_size; i++) {
+		if (hist[i] >= dmin && hist[i] < dmax) {
+			ret = hist[i];
+			break;
+		}
+	}
+
+	if (ret < dmin)
+		ret = (dmin + dmax) / 2;
+
+	ret = max(runtime, ret);
+out:
+	trace_sched_update_pred_demand(rq, p, runtime, ret);
+	return ret;
+}
+
+/* Record the busy time of @p's last window and predict the next one */
+static u32 predict_and_update_buckets(struct rq *rq, struct task_struct *p,
+				      u32 runtime)
+{
+	int bidx = busy_to_bucket(runtime);
+	u32 pred_demand = get_pred_busy(rq, p, bidx, runtime);
+
+	bucket_increase(p->ravg.busy_buckets, bidx);
+
+	return pred_demand;
+}
+
+/*
+ * If @p's current window is already busier than predicted, raise the
+ * prediction to what the histogram says such a window ends up at.
+ */
+static void update_task_pred_demand(struct rq *rq, struct task_struct *p,
+				    int event)
+{
+	u32 new;
+
+	if (is_idle_task(p) || exiting_task(p))
+		return;
+
+	if (event != PUT_PREV_TASK && event != TASK_UPDATE &&
+	    (!sched_freq_account_wait_time ||
+	     (event != TASK_MIGRATE && event != PICK_NEXT_TASK)))
+		return;
+
+	if (p->ravg.pred_demand >= p->ravg.curr_window)
+		return;
+
+	new = get_pred_busy(rq, p, busy_to_bucket(p->ravg.curr_window),
+			    p->ravg.curr_window);
+
+	if (p->on_rq && (!task_has_dl_policy(p) || !p->dl.dl_throttled))
+		p->sched_class->dec_hmp_sched_stats(rq, p);
+
+	p->ravg.pred_demand = new;
+
+	if (p->on_rq && (!task_has_dl_policy(p) || !p->dl.dl_throttled))
+		p->sched_class->inc_hmp_sched_stats(rq, p);
+}
+
 #else	/* CONFIG_SCHED_FREQ_INPUT */
 
 static inline void update_cpu_busy_time(struct task_struct *p, struct rq *rq,
@@ -2122,6 +2583,22 @@ static inline void update_cpu_busy_time(struct task_struct *p, struct rq *rq,
 {
 }
 
+static inline void update_top_task(struct task_struct *p, struct rq *rq,
+				   u64 mark_start)
+{
+}
+
+static inline u32 predict_and_update_buckets(struct rq *rq,
+					     struct task_struct *p, u32 runtime)
+{
+	return 0;
+}
+
+static inline void update_task_pred_demand(struct rq *rq,
+					   struct task_struct *p, int event)
+{
+}
+
 #endif	/* CONFIG_SCHED_FREQ_INPUT */
 
 static int account_busy_for_task_demand(struct task_struct *p, int event)
@@ -2153,7 +2630,7 @@ static void update_history(struct rq *rq, struct task_struct *p,
 {
 	u32 *hist = &p->ravg.sum_history[0];
 	int ridx, widx;
-	u32 max = 0, avg, demand;
+	u32 max = 0, avg, demand, pred_demand;
 	u64 sum = 0;
 
 	/* Ignore windows where task had no activity */
@@ -2197,8 +2674,12 @@ static void update_history(struct rq *rq, struct task_struct *p,
 		demand = avg;
 	else
 		demand = max(avg, runtime);
+	pred_demand = predict_and_update_buckets(rq, p, runtime);
 
 	p->ravg.demand = demand;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	p->ravg.pred_demand = pred_demand;
+#endif
 
 	if (p->on_rq && (!task_has_dl_policy(p) || !p->dl.dl_throttled))
 		p->sched_class->inc_hmp_sched_stats(rq, p);
@@ -2334,6 +2815,12 @@ static void update_task_ravg(struct task_struct *p, struct rq *rq,
 
 	update_task_demand(p, rq, event, wallclock);
 	update_cpu_busy_time(p, rq, event, wallclock, irqtime);
+	update_task_pred_demand(rq, p, event);
+	update_top_task(p, rq, p->ravg.mark_start);
+
+	/* The rq's busy time rolls over with the current task's window */
+	if (p == rq->curr && p->ravg.mark_start < rq->window_start)
+		cpufreq_update_util(rq, wallclock, SCHED_CPUFREQ_WINDOW);
 
 done:
 	trace_sched_update_task_ravg(p, rq, event, wallclock, irqtime);
@@ -2423,6 +2910,7 @@ static inline void set_window_start(struct rq *rq)
 		rq->window_start = cpu_rq(sync_cpu)->window_start;
 #ifdef CONFIG_SCHED_FREQ_INPUT
 		rq->curr_runnable_sum = rq->prev_runnable_sum = 0;
+		rq->curr_top = rq->prev_top = 0;
 #endif
 		raw_spin_unlock(&sync_rq->lock);
 	}
@@ -2563,6 +3051,7 @@ void reset_all_window_stats(u64 window_start, unsigned int window_size)
 		}
 #ifdef CONFIG_SCHED_FREQ_INPUT
 		rq->curr_runnable_sum = rq->prev_runnable_sum = 0;
+		rq->curr_top = rq->prev_top = 0;
 #endif
 		reset_cpu_hmp_stats(cpu, 1);
 
@@ -2633,7 +3122,7 @@ unsigned long sched_get_busy(int cpu)
 	 */
 	raw_spin_lock_irqsave(&rq->lock, flags);
 	update_task_ravg(rq->curr, rq, TASK_UPDATE, sched_ktime_clock(), 0);
-	load = rq->old_busy_time = rq->prev_runnable_sum;
+	load = rq->old_busy_time = freq_policy_load(rq);
 
 	/*
 	 * Scale load in reference to cluster->max_possible_freq.
@@ -2667,6 +3156,26 @@ unsigned long sched_get_busy(int cpu)
 	return load;
 }
 
+/**
+ * sched_get_cpu_util - busy time of @cpu in its last complete window
+ * @cpu: the CPU to look at
+ * @util: busy time, scaled to @cpu's max possible frequency
+ * @max: the window size, in the same units
+ *
+ * Meant for cpufreq_update_util() callbacks. Unlike sched_get_busy() it
+ * neither takes rq->lock nor brings the window stats up to date, so it
+ * may be used on the other CPUs of a frequency domain from within the
+ * callback; their load may then be up to a window old.
+ */
+void sched_get_cpu_util(int cpu, unsigned long *util, unsigned long *max)
+{
+	u64 load = freq_policy_load(cpu_rq(cpu));
+
+	load = scale_load_to_cpu(load, cpu);
+	*max = max_task_load();
+	*util = min_t(u64, load, *max);
+}
+
 void sched_set_io_is_busy(int val)
 {
 	sched_io_is_busy = val;
@@ -2766,6 +3275,9 @@ static void fixup_busy_time(struct task_struct *p, int new_cpu)
 		dest_rq->prev_runnable_sum += p->ravg.prev_window;
 	}
 
+	dest_rq->curr_top = max(dest_rq->curr_top, p->ravg.curr_window);
+	dest_rq->prev_top = max(dest_rq->prev_top, p->ravg.prev_window);
+
 	BUG_ON((s64)src_rq->prev_runnable_sum < 0);
 	BUG_ON((s64)src_rq->curr_runnable_sum < 0);
 
@@ -3032,22 +3544,20 @@ done:
 	return 0;
 }
 
-static int cpufreq_notifier_trans(struct notifier_block *nb,
-		unsigned long val, void *data)
+/*
+ * Account the time spent at the old frequency before switching the
+ * cluster of @cpu to @new_freq. Called from the cpufreq transition
+ * notifier, and directly by governors that switch frequency without
+ * sending notifications. Must not be called with any rq->lock held.
+ */
+void sched_update_cur_freq(int cpu, unsigned int new_freq)
 {
-	struct cpufreq_freqs *freq = (struct cpufreq_freqs *)data;
-	unsigned int cpu = freq->cpu, new_freq = freq->new;
 	struct sched_cluster *cluster = cpu_rq(cpu)->cluster;
 	unsigned long flags;
 	int i;
 
-	if (val != CPUFREQ_POSTCHANGE)
-		return 0;
-
-	BUG_ON(!new_freq);
-
 	if (cpu_cur_freq(cpu) == new_freq)
-		return 0;
+		return;
 
 	for_each_cpu_mask(i, cluster->cpus) {
 		struct rq *rq = cpu_rq(i);
@@ -3058,6 +3568,19 @@ static int cpufreq_notifier_trans(struct notifier_block *nb,
 	}
 
 	cluster->cur_freq = new_freq;
+}
+
+static int cpufreq_notifier_trans(struct notifier_block *nb,
+		unsigned long val, void *data)
+{
+	struct cpufreq_freqs *freq = (struct cpufreq_freqs *)data;
+
+	if (val != CPUFREQ_POSTCHANGE)
+		return 0;
+
+	BUG_ON(!freq->new);
+
+	sched_update_cur_freq(freq->cpu, freq->new);
 
 	return 0;
 }
@@ -3361,6 +3884,25 @@ EXPORT_SYMBOL_GPL(kick_process);
 #endif /* CONFIG_SMP */
 
 #ifdef CONFIG_SMP
+/*
+ * An allowed CPU for @p that is not isolated, preferring @cpu's
+ * siblings, or @cpu itself if @p may only run on isolated CPUs.
+ */
+static int unisolated_cpu(struct task_struct *p, int cpu)
+{
+	cpumask_t cpus;
+	int dest;
+
+	cpumask_andnot(&cpus, tsk_cpus_allowed(p), cpu_isolated_mask);
+	cpumask_and(&cpus, &cpus, cpu_active_mask);
+
+	dest = cpumask_any_and(&cpus, topology_core_cpumask(cpu));
+	if (dest >= nr_cpu_ids)
+		dest = cpumask_any(&cpus);
+
+	return dest < nr_cpu_ids ? dest : cpu;
+}
+
 /*
  * ->cpus_allowed is protected by both rq->lock and p->pi_lock
  */
@@ -3456,6 +3998,9 @@ int select_task_rq(struct task_struct *p, int sd_flags, int wake_flags)
 		     !cpu_online(cpu)))
 		cpu = select_fallback_rq(task_cpu(p), p);
 
+	if (unlikely(cpu_isolated(cpu)))
+		cpu = unisolated_cpu(p, cpu);
+
 	return cpu;
 }
 
@@ -5242,6 +5787,13 @@ void scheduler_tick(void)
 	if (update_preferred_cluster(grp, curr, old_load))
 		set_preferred_cluster(grp);
 
+	if (grp)
+		check_frame_deadline(grp);
+
+#ifdef CONFIG_SCHED_CORE_CTL
+	core_ctl_check(rq->window_start);
+#endif
+
 	if (curr->sched_class == &fair_sched_class)
 		check_for_migration(rq, curr);
 }
@@ -7864,6 +8416,148 @@ static int migration_cpu_stop(void *data)
 	return 0;
 }
 
+/*
+ * CPU isolation: an isolated CPU stays online but takes no load. Its
+ * queued tasks are moved off, and wakeups, RT pushes, load balancing and
+ * new unpinned timers keep away from it, so it can sit in its deepest
+ * C-state. Tasks that may run nowhere else, and interrupts, still run
+ * there. Unlike hotplug this needs no stop_machine() and leaves the
+ * sched domains alone, so a CPU can be parked or unparked quickly.
+ */
+static DEFINE_MUTEX(cpu_isolation_lock);
+static int cpu_isolation_vote[NR_CPUS];
+
+/* A queued task that can leave @rq's isolated CPU, and where to */
+static struct task_struct *isolation_next_task(struct rq *rq, int *dest)
+{
+	int cpu = cpu_of(rq);
+	struct task_struct *p;
+
+	list_for_each_entry(p, &rq->cfs_tasks, se.group_node) {
+		*dest = unisolated_cpu(p, cpu);
+		if (*dest != cpu)
+			return p;
+	}
+
+	plist_for_each_entry(p, &rq->rt.pushable_tasks, pushable_tasks) {
+		*dest = unisolated_cpu(p, cpu);
+		if (*dest != cpu)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs on the CPU being isolated, so none of its tasks is running and
+ * none can be placed on it any more.
+ */
+static int isolate_cpu_stop(void *data)
+{
+	int cpu = raw_smp_processor_id();
+	struct rq *rq = cpu_rq(cpu);
+	struct task_struct *p;
+	int dest, budget;
+
+	local_irq_disable();
+
+	/* Bounded, in case tasks keep changing affinity under us */
+	budget = 2 * rq->nr_running;
+	while (budget--) {
+		raw_spin_lock(&rq->lock);
+		p = isolation_next_task(rq, &dest);
+		if (p)
+			get_task_struct(p);
+		raw_spin_unlock(&rq->lock);
+
+		if (!p)
+			break;
+
+		__migrate_task(p, cpu, dest);
+		put_task_struct(p);
+	}
+
+	local_irq_enable();
+	return 0;
+}
+
+/**
+ * sched_isolate_cpu - keep load off an online CPU
+ * @cpu: the CPU to isolate
+ *
+ * Isolation requests nest: @cpu stays isolated until each has been
+ * undone by sched_unisolate_cpu(). The last unisolated online CPU
+ * cannot be isolated.
+ */
+int sched_isolate_cpu(int cpu)
+{
+	cpumask_t avail;
+	int ret = 0;
+
+	mutex_lock(&cpu_isolation_lock);
+	get_online_cpus();
+
+	if (!cpu_online(cpu)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (cpu_isolation_vote[cpu]) {
+		cpu_isolation_vote[cpu]++;
+		goto out;
+	}
+
+	cpumask_andnot(&avail, cpu_online_mask, cpu_isolated_mask);
+	cpumask_clear_cpu(cpu, &avail);
+	if (cpumask_empty(&avail)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	cpu_isolation_vote[cpu] = 1;
+	set_cpu_isolated(cpu, true);
+	stop_one_cpu(cpu, isolate_cpu_stop, NULL);
+	trace_sched_isolate(cpu, 1, cpumask_bits(cpu_isolated_mask)[0]);
+out:
+	put_online_cpus();
+	mutex_unlock(&cpu_isolation_lock);
+	return ret;
+}
+
+int sched_unisolate_cpu(int cpu)
+{
+	int ret = 0;
+
+	mutex_lock(&cpu_isolation_lock);
+	get_online_cpus();
+
+	if (!cpu_isolation_vote[cpu]) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (--cpu_isolation_vote[cpu])
+		goto out;
+
+	set_cpu_isolated(cpu, false);
+	trace_sched_isolate(cpu, 0, cpumask_bits(cpu_isolated_mask)[0]);
+
+	/* Kick it, so that it pulls load instead of idling on */
+	if (cpu_online(cpu))
+		smp_send_reschedule(cpu);
+out:
+	put_online_cpus();
+	mutex_unlock(&cpu_isolation_lock);
+	return ret;
+}
+
+/* Called once @cpu is dead; hotplug excludes sched_isolate_cpu() */
+static void clear_cpu_isolation(int cpu)
+{
+	cpu_isolation_vote[cpu] = 0;
+	set_cpu_isolated(cpu, false);
+}
+
 #ifdef CONFIG_HOTPLUG_CPU
 
 /*
@@ -8200,6 +8894,7 @@ migration_call(struct notifier_block *nfb, unsigned long action, void *hcpu)
 		break;
 
 	case CPU_DEAD:
+		clear_cpu_isolation(cpu);
 		clear_hmp_request(cpu);
 		calc_load_migrate(rq);
 		break;
@@ -10055,6 +10750,9 @@ void __init sched_init(void)
 #ifdef CONFIG_SCHED_HMP
 		cpumask_set_cpu(i, &rq->freq_domain_cpumask);
 		rq->hmp_stats.cumulative_runnable_avg = 0;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+		rq->hmp_stats.pred_demands_sum = 0;
+#endif
 		rq->window_start = 0;
 		rq->hmp_stats.nr_small_tasks = rq->hmp_stats.nr_big_tasks = 0;
 		rq->hmp_flags = 0;
@@ -10074,6 +10772,7 @@ void __init sched_init(void)
 #ifdef CONFIG_SCHED_FREQ_INPUT
 		rq->old_busy_time = 0;
 		rq->curr_runnable_sum = rq->prev_runnable_sum = 0;
+		rq->curr_top = rq->prev_top = 0;
 		rq->notifier_sent = 0;
 #endif
 #endif
@@ -0,0 +1,455 @@
+/*
+ * Load-driven CPU isolation ("core control")
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Once per scheduler window, each cluster's need for CPUs is worked out
+ * from how many of its CPUs were busy and from its average nr_running.
+ * A per-cluster thread then isolates or unisolates CPUs to match, so
+ * spare cores are parked and unparked without going through hotplug.
+ *
+ * Tunables live in /sys/devices/system/cpu/cpuN/core_ctl/ for the first
+ * CPU N of each cluster. Core control does nothing until "enable" is
+ * set.
+ */
+
+#define pr_fmt(fmt)	"core_ctl: " fmt
+
+#include <linux/cpu.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/rt.h>
+#include <trace/events/sched.h>
+
+#include "sched.h"
+
+struct cluster_data {
+	struct cpumask cpus;
+	unsigned int first_cpu;
+	unsigned int num_cpus;
+
+	/* tunables */
+	unsigned int min_cpus;
+	unsigned int max_cpus;
+	unsigned int busy_up_thres;
+	unsigned int busy_down_thres;
+	unsigned int offline_delay_ms;
+	bool enable;
+
+	/* evaluation state, under state_lock */
+	unsigned int need_cpus;
+	u64 need_ts;
+	struct cpumask busy_cpus;
+	struct sched_nr_snapshot nr_snap;
+
+	/* CPUs isolated by us, only touched by the thread */
+	struct cpumask isolated_cpus;
+
+	spinlock_t pending_lock;
+	bool pending;
+	struct task_struct *thread;
+	struct kobject kobj;
+};
+
+static struct cluster_data cluster_state[NR_CPUS];
+static unsigned int num_clusters;
+static DEFINE_SPINLOCK(state_lock);
+static u64 last_window;
+static bool initialized;
+
+#define for_each_cluster(cl, idx) \
+	for ((idx) = 0, (cl) = &cluster_state[0]; (idx) < num_clusters; \
+	     (idx)++, (cl) = &cluster_state[idx])
+
+static unsigned int active_cpus(struct cluster_data *cl)
+{
+	cpumask_t cpus;
+
+	cpumask_and(&cpus, &cl->cpus, cpu_online_mask);
+	cpumask_andnot(&cpus, &cpus, cpu_isolated_mask);
+
+	return cpumask_weight(&cpus);
+}
+
+static void wake_up_core_ctl(struct cluster_data *cl)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cl->pending_lock, flags);
+	cl->pending = true;
+	spin_unlock_irqrestore(&cl->pending_lock, flags);
+
+	wake_up_process(cl->thread);
+}
+
+/* ========================= need evaluation ========================= */
+
+static unsigned int nr_busy_cpus(struct cluster_data *cl)
+{
+	unsigned long util, max;
+	unsigned int busy, nr_busy = 0;
+	int cpu;
+
+	for_each_cpu(cpu, &cl->cpus) {
+		busy = 0;
+		if (cpu_online(cpu)) {
+			sched_get_cpu_util(cpu, &util, &max);
+			busy = max ? util * 100 / max : 0;
+		}
+
+		/* A busy CPU stays busy until it drops below busy_down_thres */
+		if (busy >= cl->busy_up_thres ||
+		    (cpumask_test_cpu(cpu, &cl->busy_cpus) &&
+		     busy >= cl->busy_down_thres)) {
+			cpumask_set_cpu(cpu, &cl->busy_cpus);
+			nr_busy++;
+		} else {
+			cpumask_clear_cpu(cpu, &cl->busy_cpus);
+		}
+	}
+
+	return nr_busy;
+}
+
+static bool eval_need(struct cluster_data *cl, u64 now)
+{
+	unsigned int nr_busy, need, old_need = cl->need_cpus;
+	int avg, iowait_avg, big_avg;
+
+	nr_busy = nr_busy_cpus(cl);
+	sched_get_nr_running_avg_cpus(&cl->cpus, &cl->nr_snap,
+				      &avg, &iowait_avg, &big_avg);
+
+	need = max_t(unsigned int, nr_busy, DIV_ROUND_UP(avg, 100));
+	need = clamp(need, cl->min_cpus, cl->max_cpus);
+
+	/* Take CPUs right away, give them back only after offline_delay_ms */
+	if (need >= old_need)
+		cl->need_ts = now;
+	else if (now - cl->need_ts < (u64)cl->offline_delay_ms * NSEC_PER_MSEC)
+		need = old_need;
+
+	trace_core_ctl_eval_need(cl->first_cpu, avg, nr_busy, old_need, need);
+	cl->need_cpus = need;
+
+	return cl->enable && need != active_cpus(cl);
+}
+
+/**
+ * core_ctl_check - reevaluate every cluster once per window
+ * @window_start: start of the caller's current window
+ *
+ * Called from the scheduler tick.
+ */
+void core_ctl_check(u64 window_start)
+{
+	struct cluster_data *cl;
+	unsigned int i;
+
+	if (!initialized || window_start == last_window)
+		return;
+
+	if (!spin_trylock(&state_lock))
+		return;
+
+	if (window_start != last_window) {
+		last_window = window_start;
+		for_each_cluster(cl, i)
+			if (eval_need(cl, window_start))
+				wake_up_core_ctl(cl);
+	}
+
+	spin_unlock(&state_lock);
+}
+
+/* ====================== isolation and unisolation ===================== */
+
+static void try_to_isolate(struct cluster_data *cl, unsigned int need)
+{
+	unsigned int active = active_cpus(cl);
+	int cpu, pass;
+
+	/* Park idle CPUs before busy ones */
+	for (pass = 0; pass < 2 && active > need; pass++) {
+		for_each_cpu_and(cpu, &cl->cpus, cpu_online_mask) {
+			if (active <= need)
+				break;
+			if (cpu_isolated(cpu))
+				continue;
+			if (!pass && cpumask_test_cpu(cpu, &cl->busy_cpus))
+				continue;
+
+			if (!sched_isolate_cpu(cpu)) {
+				cpumask_set_cpu(cpu, &cl->isolated_cpus);
+				active--;
+			}
+		}
+	}
+}
+
+static void try_to_unisolate(struct cluster_data *cl, unsigned int need)
+{
+	unsigned int active = active_cpus(cl);
+	int cpu;
+
+	for_each_cpu(cpu, &cl->isolated_cpus) {
+		if (active >= need)
+			break;
+
+		/* Hotplug may have dropped our isolation already */
+		cpumask_clear_cpu(cpu, &cl->isolated_cpus);
+		if (!sched_unisolate_cpu(cpu) && cpu_online(cpu))
+			active++;
+	}
+}
+
+static void do_core_ctl(struct cluster_data *cl)
+{
+	unsigned int need;
+
+	need = ACCESS_ONCE(cl->enable) ? ACCESS_ONCE(cl->need_cpus) :
+					 cl->num_cpus;
+
+	if (active_cpus(cl) > need)
+		try_to_isolate(cl, need);
+	else
+		try_to_unisolate(cl, need);
+}
+
+static int try_core_ctl(void *data)
+{
+	struct cluster_data *cl = data;
+	unsigned long flags;
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irqsave(&cl->pending_lock, flags);
+		if (!cl->pending) {
+			spin_unlock_irqrestore(&cl->pending_lock, flags);
+			schedule();
+			if (kthread_should_stop())
+				break;
+			spin_lock_irqsave(&cl->pending_lock, flags);
+		}
+		set_current_state(TASK_RUNNING);
+		cl->pending = false;
+		spin_unlock_irqrestore(&cl->pending_lock, flags);
+
+		do_core_ctl(cl);
+	}
+
+	return 0;
+}
+
+/* =============================== sysfs =============================== */
+
+struct core_ctl_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct cluster_data *cl, char *buf);
+	ssize_t (*store)(struct cluster_data *cl, const char *buf,
+			 size_t count);
+};
+
+#define to_cluster_data(k) container_of(k, struct cluster_data, kobj)
+#define to_attr(a) container_of(a, struct core_ctl_attr, attr)
+
+#define core_ctl_tunable(name, lo, hi)					\
+static ssize_t show_##name(struct cluster_data *cl, char *buf)		\
+{									\
+	return snprintf(buf, PAGE_SIZE, "%u\n", cl->name);		\
+}									\
+									\
+static ssize_t store_##name(struct cluster_data *cl, const char *buf,	\
+			    size_t count)				\
+{									\
+	unsigned int val;						\
+									\
+	if (kstrtouint(buf, 0, &val) || val < (lo) || val > (hi))	\
+		return -EINVAL;						\
+									\
+	cl->name = val;							\
+	wake_up_core_ctl(cl);						\
+	return count;							\
+}									\
+									\
+static struct core_ctl_attr name =					\
+	__ATTR(name, 0644, show_##name, store_##name)
+
+core_ctl_tunable(min_cpus, 1, cl->max_cpus);
+core_ctl_tunable(max_cpus, cl->min_cpus, cl->num_cpus);
+core_ctl_tunable(busy_up_thres, cl->busy_down_thres, 100);
+core_ctl_tunable(busy_down_thres, 0, cl->busy_up_thres);
+core_ctl_tunable(offline_delay_ms, 0, UINT_MAX);
+
+static ssize_t show_enable(struct cluster_data *cl, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", cl->enable);
+}
+
+static ssize_t store_enable(struct cluster_data *cl, const char *buf,
+			    size_t count)
+{
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+
+	cl->enable = !!val;
+	wake_up_core_ctl(cl);
+	return count;
+}
+
+static struct core_ctl_attr enable =
+	__ATTR(enable, 0644, show_enable, store_enable);
+
+static ssize_t show_need_cpus(struct cluster_data *cl, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", cl->need_cpus);
+}
+
+static struct core_ctl_attr need_cpus =
+	__ATTR(need_cpus, 0444, show_need_cpus, NULL);
+
+static ssize_t show_active_cpus(struct cluster_data *cl, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", active_cpus(cl));
+}
+
+static struct core_ctl_attr active_cpus_attr =
+	__ATTR(active_cpus, 0444, show_active_cpus, NULL);
+
+static ssize_t show_global_state(struct cluster_data *cl, char *buf)
+{
+	ssize_t count = 0;
+	int cpu;
+
+	for_each_cpu(cpu, &cl->cpus)
+		count += snprintf(buf + count, PAGE_SIZE - count,
+				  "CPU%d: online %d isolated %d busy %d\n",
+				  cpu, cpu_online(cpu), cpu_isolated(cpu),
+				  cpumask_test_cpu(cpu, &cl->busy_cpus));
+
+	return count;
+}
+
+static struct core_ctl_attr global_state =
+	__ATTR(global_state, 0444, show_global_state, NULL);
+
+static struct attribute *default_attrs[] = {
+	&min_cpus.attr,
+	&max_cpus.attr,
+	&busy_up_thres.attr,
+	&busy_down_thres.attr,
+	&offline_delay_ms.attr,
+	&enable.attr,
+	&need_cpus.attr,
+	&active_cpus_attr.attr,
+	&global_state.attr,
+	NULL
+};
+
+static ssize_t show(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	struct core_ctl_attr *cattr = to_attr(attr);
+
+	if (!cattr->show)
+		return -EIO;
+
+	return cattr->show(to_cluster_data(kobj), buf);
+}
+
+static ssize_t store(struct kobject *kobj, struct attribute *attr,
+		     const char *buf, size_t count)
+{
+	struct core_ctl_attr *cattr = to_attr(attr);
+
+	if (!cattr->store)
+		return -EIO;
+
+	return cattr->store(to_cluster_data(kobj), buf, count);
+}
+
+static const struct sysfs_ops sysfs_ops = {
+	.show	= show,
+	.store	= store,
+};
+
+static struct kobj_type ktype_core_ctl = {
+	.sysfs_ops	= &sysfs_ops,
+	.default_attrs	= default_attrs,
+};
+
+/* ============================ initialization ========================= */
+
+static int cluster_init(struct sched_cluster *cluster)
+{
+	struct cluster_data *cl = &cluster_state[num_clusters];
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	struct device *dev;
+	int ret;
+
+	dev = get_cpu_device(cluster_first_cpu(cluster));
+	if (!dev)
+		return -ENODEV;
+
+	cpumask_copy(&cl->cpus, &cluster->cpus);
+	cl->first_cpu = cluster_first_cpu(cluster);
+	cl->num_cpus = cpumask_weight(&cluster->cpus);
+	cl->min_cpus = 1;
+	cl->max_cpus = cl->num_cpus;
+	cl->need_cpus = cl->num_cpus;
+	cl->busy_up_thres = 60;
+	cl->busy_down_thres = 30;
+	cl->offline_delay_ms = 100;
+	spin_lock_init(&cl->pending_lock);
+
+	cl->thread = kthread_run(try_core_ctl, cl, "core_ctl/%d",
+				 cl->first_cpu);
+	if (IS_ERR(cl->thread))
+		return PTR_ERR(cl->thread);
+	sched_setscheduler_nocheck(cl->thread, SCHED_FIFO, &param);
+
+	ret = kobject_init_and_add(&cl->kobj, &ktype_core_ctl, &dev->kobj,
+				   "core_ctl");
+	if (ret) {
+		kthread_stop(cl->thread);
+		return ret;
+	}
+
+	num_clusters++;
+	return 0;
+}
+
+static int __init core_ctl_init(void)
+{
+	struct sched_cluster *cluster;
+	int cpu, ret;
+
+	for_each_possible_cpu(cpu) {
+		cluster = cpu_rq(cpu)->cluster;
+
+		/* CPUs not yet managed by cpufreq have no real cluster */
+		if (cpumask_empty(&cluster->cpus) ||
+		    cpu != cluster_first_cpu(cluster))
+			continue;
+
+		ret = cluster_init(cluster);
+		if (ret)
+			pr_warn("unable to manage cluster of cpu%d: %d\n",
+				cpu, ret);
+	}
+
+	initialized = true;
+	return 0;
+}
+late_initcall(core_ctl_init);
@@ -0,0 +1,213 @@
+/*
+ * Energy model for HMP task placement
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Each cpu node may point at an energy model node through a
+ * "sched-energy-costs" phandle. CPUs of a cluster share the node:
+ *
+ *	cpu@0 {
+ *		...
+ *		sched-energy-costs = <&CLUSTER_COST_0>;
+ *	};
+ *
+ *	CLUSTER_COST_0: cluster-cost0 {
+ *		busy-cost-data = <
+ *			 400000	 70	// <freq (KHz) power>
+ *			 800000	155
+ *			1200000	290
+ *		>;
+ *		idle-cost-data = <
+ *			 30	// WFI, rq->cstate 0
+ *			 10
+ *			  2	// deepest C-state
+ *		>;
+ *	};
+ *
+ * busy-cost-data lists the power of one busy CPU at each OPP, in
+ * ascending frequency order. idle-cost-data lists the power of one idle
+ * CPU in each C-state, indexed like rq->cstate. Both are in the same,
+ * otherwise arbitrary, unit.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/of.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "sched.h"
+
+static struct sched_energy *
+parse_energy_node(struct device_node *np, int cpu)
+{
+	struct sched_energy *e;
+	u32 *data = NULL;
+	int len, i, ret = -EINVAL;
+
+	if (!of_get_property(np, "busy-cost-data", &len) ||
+	    !len || len % (2 * sizeof(u32))) {
+		pr_warn("sched: invalid energy model %s for cpu %d\n",
+			np->full_name, cpu);
+		return NULL;
+	}
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return NULL;
+
+	e->nr_opp = len / (2 * sizeof(u32));
+	e->opp = kcalloc(e->nr_opp, sizeof(*e->opp), GFP_KERNEL);
+	data = kmalloc(len, GFP_KERNEL);
+	if (!e->opp || !data) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	if (of_property_read_u32_array(np, "busy-cost-data", data,
+				       len / sizeof(u32)))
+		goto err;
+
+	for (i = 0; i < e->nr_opp; i++) {
+		e->opp[i].freq = data[2 * i];
+		e->opp[i].power = data[2 * i + 1];
+		if (!e->opp[i].freq ||
+		    (i && e->opp[i].freq <= e->opp[i - 1].freq))
+			goto err;
+	}
+
+	if (of_get_property(np, "idle-cost-data", &len) && len) {
+		e->nr_idle = len / sizeof(u32);
+		e->idle_power = kcalloc(e->nr_idle, sizeof(u32), GFP_KERNEL);
+		if (!e->idle_power) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		if (of_property_read_u32_array(np, "idle-cost-data",
+					       e->idle_power, e->nr_idle))
+			goto err;
+	}
+
+	kfree(data);
+	return e;
+
+err:
+	if (ret == -EINVAL)
+		pr_warn("sched: invalid energy model %s for cpu %d\n",
+			np->full_name, cpu);
+	kfree(data);
+	kfree(e->idle_power);
+	kfree(e->opp);
+	kfree(e);
+	return NULL;
+}
+
+/**
+ * sched_energy_parse - read the energy model of a CPU's cluster
+ * @cpu:	any CPU of the cluster
+ *
+ * Returns NULL if the device tree describes no valid model for @cpu.
+ */
+struct sched_energy *sched_energy_parse(int cpu)
+{
+	struct device_node *cn, *np;
+	struct sched_energy *e;
+
+	cn = of_get_cpu_node(cpu, NULL);
+	if (!cn)
+		return NULL;
+
+	np = of_parse_phandle(cn, "sched-energy-costs", 0);
+	of_node_put(cn);
+	if (!np)
+		return NULL;
+
+	e = parse_energy_node(np, cpu);
+	of_node_put(np);
+
+	return e;
+}
+
+/* Lowest OPP at or above @freq, or the highest OPP */
+const struct sched_energy_opp *
+sched_energy_find_opp(struct sched_energy *e, unsigned int freq)
+{
+	int i;
+
+	for (i = 0; i < e->nr_opp - 1; i++)
+		if (e->opp[i].freq >= freq)
+			break;
+
+	return &e->opp[i];
+}
+
+unsigned int sched_energy_idle_power(struct sched_energy *e, int cstate)
+{
+	if (!e->nr_idle)
+		return 0;
+
+	return e->idle_power[clamp(cstate, 0, e->nr_idle - 1)];
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int sched_energy_show(struct seq_file *m, void *v)
+{
+	struct sched_cluster *cluster;
+	struct sched_energy *e;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		cluster = cpu_rq(cpu)->cluster;
+		if (!cluster || cpu != cluster_first_cpu(cluster))
+			continue;
+
+		seq_printf(m, "cluster %d cpus ", cluster->id);
+		seq_cpumask_list(m, &cluster->cpus);
+		seq_putc(m, '\n');
+
+		e = cluster->energy;
+		if (!e) {
+			seq_puts(m, "\tno energy model\n");
+			continue;
+		}
+
+		for (i = 0; i < e->nr_opp; i++)
+			seq_printf(m, "\tbusy %u KHz: %u\n",
+				   e->opp[i].freq, e->opp[i].power);
+		for (i = 0; i < e->nr_idle; i++)
+			seq_printf(m, "\tidle C%d: %u\n", i, e->idle_power[i]);
+	}
+
+	return 0;
+}
+
+static int sched_energy_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sched_energy_show, NULL);
+}
+
+static const struct file_operations sched_energy_fops = {
+	.open		= sched_energy_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init sched_energy_debug_init(void)
+{
+	debugfs_create_file("sched_energy", 0444, NULL, NULL,
+			    &sched_energy_fops);
+
+	return 0;
+}
+late_initcall(sched_energy_debug_init);
+#endif /* CONFIG_DEBUG_FS */
@@ -1398,6 +1398,13 @@ unsigned int __read_mostly sysctl_sched_spill_nr_run = 10;
  */
 unsigned int __read_mostly sysctl_sched_enable_power_aware = 0;
 
+/*
+ * Place waking tasks by the energy delta the device tree energy model
+ * predicts for each candidate CPU, instead of by power band, load and
+ * C-state. Has no effect unless every cluster has an energy model.
+ */
+unsigned int __read_mostly sysctl_sched_enable_energy_aware = 0;
+
 /*
  * This specifies the maximum percent power difference between 2
  * CPUs for them to be considered identical in terms of their
@@ -1851,7 +1858,15 @@ static int task_load_will_fit(struct task_struct *p, u64 task_load, int cpu)
 
 static int task_will_fit(struct task_struct *p, int cpu)
 {
-	u64 tload = scale_load_to_cpu(task_load(p), cpu);
+	u64 tload = task_load(p);
+
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	/* place a task that is predicted to burst by its burst */
+	if (!sched_use_pelt)
+		tload = max_t(u64, tload, p->ravg.pred_demand);
+#endif
+
+	tload = scale_load_to_cpu(tload, cpu);
 	return task_load_will_fit(p, tload, cpu);
 }
 
@@ -1986,6 +2001,7 @@ static int best_small_task_cpu(struct task_struct *p, int sync)
 	hmp_capable = !cpumask_full(&temp);
 
 	cpumask_and(&search_cpu, tsk_cpus_allowed(p), cpu_online_mask);
+	cpumask_andnot(&search_cpu, &search_cpu, cpu_isolated_mask);
 	if (unlikely(!cpumask_test_cpu(i, &search_cpu))) {
 		i = cpumask_first(&search_cpu);
 		if (i >= nr_cpu_ids)
@@ -2034,6 +2050,7 @@ static int best_small_task_cpu(struct task_struct *p, int sync)
 		return min_cstate_cpu;
 
 	cpumask_and(&search_cpu, tsk_cpus_allowed(p), cpu_online_mask);
+	cpumask_andnot(&search_cpu, &search_cpu, cpu_isolated_mask);
 	cpumask_andnot(&search_cpu, &search_cpu, &fb_search_cpu);
 	for_each_cpu(i, &search_cpu) {
 		rq = cpu_rq(i);
@@ -2205,6 +2222,102 @@ static int select_packing_target(struct task_struct *p, int best_cpu)
 	return target;
 }
 
+/*
+ * Energy @cluster spends over a window, in busy-power units times 1024,
+ * with an extra @tload (scaled to @cpu) running on @cpu. The cluster
+ * shares one frequency, which has to serve its busiest CPU; each CPU is
+ * busy for its load at that frequency and idles for the rest.
+ */
+static u64 cluster_energy(struct sched_cluster *cluster, int cpu, u64 tload,
+			  int sync)
+{
+	struct sched_energy *e = cluster->energy;
+	const struct sched_energy_opp *opp;
+	u64 cpu_load, max_load = 0, busy, energy = 0;
+	unsigned int freq;
+	int i, cstate;
+
+	for_each_cpu_and(i, &cluster->cpus, cpu_online_mask) {
+		cpu_load = cpu_load_sync(i, sync);
+		if (i == cpu)
+			cpu_load += tload;
+		max_load = max(max_load, cpu_load);
+	}
+
+	freq = div64_u64(max_load * cluster->max_possible_freq,
+			 max_task_load());
+	opp = sched_energy_find_opp(e, max(freq, cluster->min_freq));
+
+	for_each_cpu_and(i, &cluster->cpus, cpu_online_mask) {
+		cpu_load = cpu_load_sync(i, sync);
+		if (i == cpu)
+			cpu_load += tload;
+
+		busy = div64_u64(cpu_load * cluster->max_possible_freq *
+				 1024, (u64)max_task_load() * opp->freq);
+		busy = min_t(u64, busy, 1024);
+
+		/* A CPU that is going to run anything only idles shallowly */
+		cstate = 0;
+		if (idle_cpu(i) && !(i == cpu && tload))
+			cstate = cpu_rq(i)->cstate;
+
+		energy += busy * opp->power +
+			  (1024 - busy) * sched_energy_idle_power(e, cstate);
+	}
+
+	return energy;
+}
+
+/*
+ * Return the CPU where @p fits and adds the least energy, or -1 if some
+ * cluster has no energy model or @p fits nowhere.
+ */
+static int energy_aware_cpu(struct task_struct *p, int sync)
+{
+	struct sched_cluster *cluster;
+	cpumask_t search_cpus;
+	int i, best_cpu = -1;
+	s64 delta, min_delta = LLONG_MAX;
+	u64 tload, base;
+
+	cpumask_and(&search_cpus, tsk_cpus_allowed(p), cpu_online_mask);
+	cpumask_andnot(&search_cpus, &search_cpus, cpu_isolated_mask);
+
+	/* Walk a cluster at a time, its energy without @p is shared */
+	while ((i = cpumask_first(&search_cpus)) < nr_cpu_ids) {
+		cluster = cpu_rq(i)->cluster;
+		if (!cluster->energy)
+			return -1;
+
+		base = cluster_energy(cluster, i, 0, sync);
+		for_each_cpu_and(i, &cluster->cpus, &search_cpus) {
+			struct rq *rq = cpu_rq(i);
+
+			if (is_reserved(i) || sched_cpu_high_irqload(i))
+				continue;
+
+			tload = scale_load_to_cpu(task_load(p), i);
+			if (!task_load_will_fit(p, tload, i) ||
+			    spill_threshold_crossed(tload,
+						    cpu_load_sync(i, sync), rq))
+				continue;
+
+			delta = cluster_energy(cluster, i, tload, sync) - base;
+			trace_sched_energy_diff(p, i, tload, delta);
+
+			if (delta < min_delta ||
+			    (delta == min_delta && i == task_cpu(p))) {
+				min_delta = delta;
+				best_cpu = i;
+			}
+		}
+		cpumask_andnot(&search_cpus, &search_cpus, &cluster->cpus);
+	}
+
+	return best_cpu;
+}
+
 /*
  * Should task be woken to any available idle cpu?
  *
@@ -2270,6 +2383,15 @@ static int select_best_cpu(struct task_struct *p, int target, int reason,
 		sync = 0;
 	}
 
+	if (sysctl_sched_enable_energy_aware && !reason && !boost &&
+	    !pref_cluster && !prefer_idle_override) {
+		best_cpu = energy_aware_cpu(p, sync);
+		if (best_cpu >= 0) {
+			prefer_idle_override = 1;	/* No packing */
+			goto done;
+		}
+	}
+
 	if (small_task && !boost) {
 		best_cpu = best_small_task_cpu(p, sync);
 		prefer_idle = 0;	/* For sched_task_load tracepoint */
@@ -2278,6 +2400,7 @@ static int select_best_cpu(struct task_struct *p, int target, int reason,
 
 	trq = task_rq(p);
 	cpumask_and(&search_cpus, tsk_cpus_allowed(p), cpu_online_mask);
+	cpumask_andnot(&search_cpus, &search_cpus, cpu_isolated_mask);
 	for_each_cpu(i, &search_cpus) {
 		struct rq *rq = cpu_rq(i);
 
@@ -2497,8 +2620,12 @@ dec_rq_hmp_stats(struct rq *rq, struct task_struct *p, int change_cra)
 static void reset_hmp_stats(struct hmp_sched_stats *stats, int reset_cra)
 {
 	stats->nr_big_tasks = stats->nr_small_tasks = 0;
-	if (reset_cra)
+	if (reset_cra) {
 		stats->cumulative_runnable_avg = 0;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+		stats->pred_demands_sum = 0;
+#endif
+	}
 }
 
 
@@ -2919,8 +3046,9 @@ static inline int find_new_hmp_ilb(int call_cpu, int type)
 	for_each_domain(call_cpu, sd) {
 		for_each_cpu(i, sched_domain_span(sd)) {
 			dst_rq = cpu_rq(i);
-			if (!idle_cpu(i) || (type == NOHZ_KICK_RESTRICT
-				  && cpu_capacity(i) > cpu_capacity(call_cpu)))
+			if (!idle_cpu(i) || cpu_isolated(i) ||
+			    (type == NOHZ_KICK_RESTRICT &&
+			     cpu_capacity(i) > cpu_capacity(call_cpu)))
 				continue;
 
 			cost = power_cost_at_freq(i, min_max_freq);
@@ -3731,6 +3859,9 @@ static void init_cfs_rq_hmp_stats(struct cfs_rq *cfs_rq)
 	cfs_rq->hmp_stats.nr_big_tasks = 0;
 	cfs_rq->hmp_stats.nr_small_tasks = 0;
 	cfs_rq->hmp_stats.cumulative_runnable_avg = 0;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	cfs_rq->hmp_stats.pred_demands_sum = 0;
+#endif
 }
 
 static void inc_cfs_rq_hmp_stats(struct cfs_rq *cfs_rq,
@@ -3756,6 +3887,9 @@ static void inc_throttled_cfs_rq_hmp_stats(struct hmp_sched_stats *stats,
 	stats->nr_small_tasks += cfs_rq->hmp_stats.nr_small_tasks;
 	stats->cumulative_runnable_avg +=
 				cfs_rq->hmp_stats.cumulative_runnable_avg;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	stats->pred_demands_sum += cfs_rq->hmp_stats.pred_demands_sum;
+#endif
 }
 
 static void dec_throttled_cfs_rq_hmp_stats(struct hmp_sched_stats *stats,
@@ -3765,6 +3899,10 @@ static void dec_throttled_cfs_rq_hmp_stats(struct hmp_sched_stats *stats,
 	stats->nr_small_tasks -= cfs_rq->hmp_stats.nr_small_tasks;
 	stats->cumulative_runnable_avg -=
 				cfs_rq->hmp_stats.cumulative_runnable_avg;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	stats->pred_demands_sum -= cfs_rq->hmp_stats.pred_demands_sum;
+	BUG_ON((s64)stats->pred_demands_sum < 0);
+#endif
 
 	BUG_ON(stats->nr_big_tasks < 0 || stats->nr_small_tasks < 0 ||
 		(s64)stats->cumulative_runnable_avg < 0);
@@ -7605,6 +7743,10 @@ static int load_balance(int this_cpu, struct rq *this_rq,
 	if (idle == CPU_NEWLY_IDLE)
 		env.dst_grpmask = NULL;
 
+	/* Isolated CPUs take no load */
+	if (cpu_isolated(this_cpu))
+		return 0;
+
 	cpumask_copy(cpus, cpu_active_mask);
 
 	per_cpu(dbs_boost_load_moved, this_cpu) = 0;
@@ -8070,10 +8212,14 @@ static inline int find_new_ilb(int call_cpu, int type)
 	if (sched_enable_hmp)
 		return find_new_hmp_ilb(call_cpu, type);
 
-	ilb = cpumask_first(nohz.idle_cpus_mask);
-
-	if (ilb < nr_cpu_ids && idle_cpu(ilb))
-		return ilb;
+	/* Don't wake an isolated CPU to balance on behalf of others */
+	for_each_cpu(ilb, nohz.idle_cpus_mask) {
+		if (cpu_isolated(ilb))
+			continue;
+		if (idle_cpu(ilb))
+			return ilb;
+		break;
+	}
 
 	return nr_cpu_ids;
 }
@@ -326,6 +326,22 @@ struct cfs_bandwidth { };
 struct hmp_sched_stats {
 	int nr_big_tasks, nr_small_tasks;
 	u64 cumulative_runnable_avg;
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	u64 pred_demands_sum;
+#endif
+};
+
+/* Power of one CPU of a cluster, from the device tree */
+struct sched_energy_opp {
+	unsigned int freq;
+	unsigned int power;
+};
+
+struct sched_energy {
+	int nr_opp;
+	struct sched_energy_opp *opp;	/* ascending freq */
+	int nr_idle;
+	unsigned int *idle_power;	/* indexed by rq->cstate */
 };
 
 struct sched_cluster {
@@ -343,10 +359,18 @@ struct sched_cluster {
 	 */
 	unsigned int cur_freq, max_freq, min_freq, max_possible_freq;
 	unsigned int mostly_idle_freq;
+	struct sched_energy *energy;	/* NULL if no energy model */
+	atomic_t nr_frame_boost;	/* groups late for a frame */
 };
 
 extern unsigned long all_cluster_ids[];
 
+extern struct sched_energy *sched_energy_parse(int cpu);
+extern const struct sched_energy_opp *
+sched_energy_find_opp(struct sched_energy *e, unsigned int freq);
+extern unsigned int sched_energy_idle_power(struct sched_energy *e,
+					    int cstate);
+
 static inline int cluster_first_cpu(struct sched_cluster *cluster)
 {
 	return cpumask_first(&cluster->cpus);
@@ -360,8 +384,17 @@ struct related_thread_group {
 	struct sched_cluster *preferred_cluster;
 	struct rcu_head rcu;
 	u64 last_update;
+
+	/* Frame-aware mode, see sched_set_group_frame() */
+	u64 frame_start;		/* 0 between frames */
+	u64 frame_deadline;
+	u64 frame_time_avg;
+	struct sched_cluster *boost_cluster;	/* non-NULL while boosted */
+	unsigned int nr_frames, nr_missed_frames, nr_boosted_frames;
 };
 
+extern void check_frame_deadline(struct related_thread_group *grp);
+
 extern int group_will_fit(struct sched_cluster *cluster,
 		 struct related_thread_group *grp, u64 demand);
 #endif
@@ -683,6 +716,10 @@ struct rq {
 #ifdef CONFIG_SCHED_FREQ_INPUT
 	u64 curr_runnable_sum;
 	u64 prev_runnable_sum;
+	/* busiest single task's contribution to the sums above */
+	u32 curr_top, prev_top;
+	/* lowest frequency (KHz) requested through sched_set_freq_floor() */
+	unsigned int freq_floor;
 #endif
 
 #ifdef CONFIG_IRQ_TIME_ACCOUNTING
@@ -999,6 +1036,11 @@ inc_cumulative_runnable_avg(struct hmp_sched_stats *stats,
 			(sched_disable_window_stats ? 0 : p->ravg.demand);
 
 	stats->cumulative_runnable_avg += task_load;
+
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	if (!sched_use_pelt)
+		stats->pred_demands_sum += p->ravg.pred_demand;
+#endif
 }
 
 static inline void
@@ -1016,6 +1058,13 @@ dec_cumulative_runnable_avg(struct hmp_sched_stats *stats,
 	stats->cumulative_runnable_avg -= task_load;
 
 	BUG_ON((s64)stats->cumulative_runnable_avg < 0);
+
+#ifdef CONFIG_SCHED_FREQ_INPUT
+	if (!sched_use_pelt) {
+		stats->pred_demands_sum -= p->ravg.pred_demand;
+		BUG_ON((s64)stats->pred_demands_sum < 0);
+	}
+#endif
 }
 
 #define pct_to_real(tunable)	\
@@ -1111,6 +1160,9 @@ static inline int update_preferred_cluster(struct related_thread_group *grp,
 {
 	return 0;
 }
+
+static inline void check_frame_deadline(struct related_thread_group *grp) { }
+
 static inline void
 add_new_task_to_grp(struct task_struct *p) {}
 
@@ -1118,6 +1170,12 @@ static inline void task_note_last_sleep(struct task_struct *p, u64 wallclock) {}
 
 #endif	/* CONFIG_SCHED_HMP */
 
+#ifdef CONFIG_SCHED_CORE_CTL
+extern void core_ctl_check(u64 window_start);
+#else
+static inline void core_ctl_check(u64 window_start) { }
+#endif
+
 /*
  * Returns the rq capacity of any rq in a group. This does not play
  * well with groups where rq capacity can change independently.
@@ -1127,6 +1185,26 @@ static inline void task_note_last_sleep(struct task_struct *p, u64 wallclock) {}
 #ifdef CONFIG_SCHED_FREQ_INPUT
 extern void check_for_freq_change(struct rq *rq);
 
+DECLARE_PER_CPU(struct update_util_data *, cpufreq_update_util_data);
+
+/*
+ * Hand @rq's new load to the governor hooked into it, if any; returns
+ * whether there was one. Called with rq->lock held.
+ */
+static inline bool cpufreq_update_util(struct rq *rq, u64 time,
+				       unsigned int flags)
+{
+	struct update_util_data *data;
+
+	data = rcu_dereference_sched(per_cpu(cpufreq_update_util_data,
+					     cpu_of(rq)));
+	if (!data)
+		return false;
+
+	data->func(data, time, flags);
+	return true;
+}
+
 /* Is frequency of two cpus synchronized with each other? */
 static inline int same_freq_domain(int src_cpu, int dst_cpu)
 {
@@ -1144,6 +1222,12 @@ static inline int same_freq_domain(int src_cpu, int dst_cpu)
 
 static inline void check_for_freq_change(struct rq *rq) { }
 
+static inline bool cpufreq_update_util(struct rq *rq, u64 time,
+				       unsigned int flags)
+{
+	return false;
+}
+
 static inline int same_freq_domain(int src_cpu, int dst_cpu)
 {
 	return 1;
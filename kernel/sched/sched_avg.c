@@ -18,79 +18,130 @@
 #include <linux/hrtimer.h>
 #include <linux/sched.h>
 #include <linux/math64.h>
+#include <linux/seqlock.h>
 #include <trace/events/sched.h>
 
 #include "sched.h"
 
-static DEFINE_PER_CPU(u64, nr_prod_sum);
-static DEFINE_PER_CPU(u64, last_time);
-static DEFINE_PER_CPU(u64, nr_big_prod_sum);
-static DEFINE_PER_CPU(u64, nr);
+/*
+ * Per-CPU time integrals of nr_running, nr_big_tasks and nr_iowait. They
+ * only ever grow, so each reader keeps its own snapshot and averages the
+ * difference: readers never write here and need not exclude each other.
+ * Writers are serialized by the CPU's rq->lock; the seqcount lets readers
+ * on other CPUs see a consistent set of values without taking it.
+ *
+ * nr_big and nr_iowait are the counts the integrals grow by since
+ * last_time. Readers extrapolate from them rather than from the live
+ * counts, which change outside sched_update_nr_prod() and would let an
+ * integral seen by a reader go backwards.
+ */
+struct nr_stats {
+	seqcount_t seq;
+	u64 last_time;
+	u64 nr;
+	u64 nr_big;
+	u64 nr_iowait;
+	u64 nr_prod_sum;
+	u64 nr_big_prod_sum;
+	u64 iowait_prod_sum;
+};
+
+static DEFINE_PER_CPU(struct nr_stats, nr_stats) = {
+	.seq = SEQCNT_ZERO,
+};
+
+static struct sched_nr_snapshot nr_running_snap;
+
+/* Integrals of @cpu's counts up to @now, without writing anything back */
+static void nr_stats_read(int cpu, u64 now, u64 *nr_sum, u64 *big_sum,
+			  u64 *iowait_sum)
+{
+	struct nr_stats *st = &per_cpu(nr_stats, cpu);
+	unsigned int seq;
+	u64 diff;
 
-static DEFINE_PER_CPU(unsigned long, iowait_prod_sum);
-static DEFINE_PER_CPU(spinlock_t, nr_lock) = __SPIN_LOCK_UNLOCKED(nr_lock);
-static s64 last_get_time;
+	do {
+		seq = read_seqcount_begin(&st->seq);
+
+		/* sched_clock() of another CPU may lag behind ours */
+		diff = now > st->last_time ? now - st->last_time : 0;
+
+		*nr_sum = st->nr_prod_sum + st->nr * diff;
+		*big_sum = st->nr_big_prod_sum + st->nr_big * diff;
+		*iowait_sum = st->iowait_prod_sum + st->nr_iowait * diff;
+	} while (read_seqcount_retry(&st->seq, seq));
+}
 
 /**
- * sched_get_nr_running_avg
- * @return: Average nr_running, iowait and nr_big_tasks value since last poll.
- *	    Returns the avg * 100 to return up to two decimal points
- *	    of accuracy.
+ * sched_get_nr_running_avg_cpus
+ * @cpus: CPUs to average over, e.g. a cluster
+ * @snap: the caller's state, zeroed before the first call
+ * @avg, @iowait_avg, @big_avg: set to the sum over @cpus of the average
+ *	nr_running, nr_iowait and nr_big_tasks since the caller's last
+ *	call, times 100 for two decimal points of accuracy
  *
- * Obtains the average nr_running value since the last poll.
- * This function may not be called concurrently with itself
+ * Does not take any lock, so it may be polled often and by several
+ * callers at once, provided each has its own @snap.
  */
-void sched_get_nr_running_avg(int *avg, int *iowait_avg, int *big_avg)
+void sched_get_nr_running_avg_cpus(const struct cpumask *cpus,
+				   struct sched_nr_snapshot *snap,
+				   int *avg, int *iowait_avg, int *big_avg)
 {
-	int cpu;
 	u64 curr_time = sched_clock();
-	u64 diff = curr_time - last_get_time;
-	u64 tmp_avg = 0, tmp_iowait = 0, tmp_big_avg = 0;
+	u64 nr_sum = 0, big_sum = 0, iowait_sum = 0;
+	u64 nr, big, iowait, diff;
+	int cpu;
 
 	*avg = 0;
 	*iowait_avg = 0;
 	*big_avg = 0;
 
-	if (!diff)
-		return;
-
-	/* read and reset nr_running counts */
-	for_each_possible_cpu(cpu) {
-		unsigned long flags;
-
-		spin_lock_irqsave(&per_cpu(nr_lock, cpu), flags);
-		curr_time = sched_clock();
-		diff = curr_time - per_cpu(last_time, cpu);
-		BUG_ON((s64)diff < 0);
-
-		tmp_avg += per_cpu(nr_prod_sum, cpu);
-		tmp_avg += per_cpu(nr, cpu) * diff;
-
-		tmp_big_avg += per_cpu(nr_big_prod_sum, cpu);
-		tmp_big_avg += nr_eligible_big_tasks(cpu) * diff;
-
-		tmp_iowait += per_cpu(iowait_prod_sum, cpu);
-		tmp_iowait +=  nr_iowait_cpu(cpu) * diff;
+	for_each_cpu(cpu, cpus) {
+		nr_stats_read(cpu, curr_time, &nr, &big, &iowait);
+		nr_sum += nr;
+		big_sum += big;
+		iowait_sum += iowait;
+	}
 
-		per_cpu(last_time, cpu) = curr_time;
+	diff = curr_time - snap->time;
+	nr = nr_sum - snap->nr_sum;
+	big = big_sum - snap->nr_big_sum;
+	iowait = iowait_sum - snap->iowait_sum;
 
-		per_cpu(nr_prod_sum, cpu) = 0;
-		per_cpu(nr_big_prod_sum, cpu) = 0;
-		per_cpu(iowait_prod_sum, cpu) = 0;
+	snap->time = curr_time;
+	snap->nr_sum = nr_sum;
+	snap->nr_big_sum = big_sum;
+	snap->iowait_sum = iowait_sum;
 
-		spin_unlock_irqrestore(&per_cpu(nr_lock, cpu), flags);
-	}
+	if (!diff || (s64)diff < 0)
+		return;
 
-	diff = curr_time - last_get_time;
-	last_get_time = curr_time;
+	/* Clock skew between CPUs can still make one of them dip a little */
+	if ((s64)nr > 0)
+		*avg = (int)div64_u64(nr * 100, diff);
+	if ((s64)big > 0)
+		*big_avg = (int)div64_u64(big * 100, diff);
+	if ((s64)iowait > 0)
+		*iowait_avg = (int)div64_u64(iowait * 100, diff);
+}
+EXPORT_SYMBOL(sched_get_nr_running_avg_cpus);
 
-	*avg = (int)div64_u64(tmp_avg * 100, diff);
-	*big_avg = (int)div64_u64(tmp_big_avg * 100, diff);
-	*iowait_avg = (int)div64_u64(tmp_iowait * 100, diff);
+/**
+ * sched_get_nr_running_avg
+ * @return: Average nr_running, iowait and nr_big_tasks value since last poll.
+ *	    Returns the avg * 100 to return up to two decimal points
+ *	    of accuracy.
+ *
+ * Obtains the average nr_running value since the last poll.
+ * This function may not be called concurrently with itself
+ */
+void sched_get_nr_running_avg(int *avg, int *iowait_avg, int *big_avg)
+{
+	sched_get_nr_running_avg_cpus(cpu_possible_mask, &nr_running_snap,
+				      avg, iowait_avg, big_avg);
 
 	trace_sched_get_nr_running_avg(*avg, *big_avg, *iowait_avg);
 
-	BUG_ON(*avg < 0 || *big_avg < 0 || *iowait_avg < 0);
 	pr_debug("%s - avg:%d big_avg:%d iowait_avg:%d\n",
 				 __func__, *avg, *big_avg, *iowait_avg);
 }
@@ -103,27 +154,31 @@ EXPORT_SYMBOL(sched_get_nr_running_avg);
  * @inc: Whether we are increasing or decreasing the count
  * @return: N/A
  *
- * Update average with latest nr_running value for CPU
+ * Update average with latest nr_running value for CPU. Called with
+ * @cpu's rq->lock held.
  */
 void sched_update_nr_prod(int cpu, long delta, bool inc)
 {
+	struct nr_stats *st = &per_cpu(nr_stats, cpu);
 	u64 diff;
 	u64 curr_time;
-	unsigned long flags, nr_running;
+	unsigned long nr_running;
 
-	spin_lock_irqsave(&per_cpu(nr_lock, cpu), flags);
-	nr_running = per_cpu(nr, cpu);
+	write_seqcount_begin(&st->seq);
+	nr_running = st->nr;
 	curr_time = sched_clock();
-	diff = curr_time - per_cpu(last_time, cpu);
+	diff = curr_time - st->last_time;
 	BUG_ON((s64)diff < 0);
-	per_cpu(last_time, cpu) = curr_time;
-	per_cpu(nr, cpu) = nr_running + (inc ? delta : -delta);
+	st->last_time = curr_time;
+	st->nr = nr_running + (inc ? delta : -delta);
 
-	BUG_ON((s64)per_cpu(nr, cpu) < 0);
+	BUG_ON((s64)st->nr < 0);
 
-	per_cpu(nr_prod_sum, cpu) += nr_running * diff;
-	per_cpu(nr_big_prod_sum, cpu) += nr_eligible_big_tasks(cpu) * diff;
-	per_cpu(iowait_prod_sum, cpu) += nr_iowait_cpu(cpu) * diff;
-	spin_unlock_irqrestore(&per_cpu(nr_lock, cpu), flags);
+	st->nr_prod_sum += nr_running * diff;
+	st->nr_big_prod_sum += st->nr_big * diff;
+	st->iowait_prod_sum += st->nr_iowait * diff;
+	st->nr_big = nr_eligible_big_tasks(cpu);
+	st->nr_iowait = nr_iowait_cpu(cpu);
+	write_seqcount_end(&st->seq);
 }
 EXPORT_SYMBOL(sched_update_nr_prod);
@@ -0,0 +1,521 @@
+/*
+ * binder_bench - measure binder transaction throughput under contention
+ *
+ * Starts N receiver processes and N sender processes. Each sender makes
+ * synchronous transactions to its own receiver for a fixed time. With a
+ * single driver-wide lock, unrelated pairs serialize and the aggregate
+ * rate stops scaling with N; with fine-grained locking it should scale
+ * with the number of CPUs.
+ *
+ * The parent process is the context manager. Receivers register a binder
+ * object with it, and senders look their receiver's handle up from it,
+ * much like servicemanager does.
+ *
+ *	binder_bench [-p pairs] [-d seconds] [-s payload_bytes]
+ *
+ * Needs /dev/binder and permission to become the context manager, so it
+ * can't run while servicemanager is up.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "linux/android/binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(1024 * 1024)
+#define MAX_PAIRS	64
+#define MAX_PAYLOAD	4096
+
+#define CODE_REGISTER	1
+#define CODE_LOOKUP	2
+#define CODE_PING	3
+
+struct shared {
+	volatile int mgr_ready;
+	volatile int ready;
+	volatile int start;
+	unsigned long long count[MAX_PAIRS];
+};
+
+static struct shared *shared;
+static int pairs = 4;
+static int duration = 5;
+static int payload = 64;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int binder_open(void)
+{
+	struct binder_version version;
+	int fd;
+
+	fd = open(BINDER_DEV, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (ioctl(fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		close(fd);
+		return -1;
+	}
+
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) ==
+	    MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int binder_write(int fd, void *data, size_t len)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = len;
+	bwr.write_buffer = (uintptr_t)data;
+	return ioctl(fd, BINDER_WRITE_READ, &bwr);
+}
+
+/* Commands queued for a single BINDER_WRITE_READ */
+struct cmd_buf {
+	size_t len;
+	char buf[256];
+};
+
+static void cmd_put(struct cmd_buf *c, uint32_t cmd, const void *arg,
+		    size_t len)
+{
+	memcpy(c->buf + c->len, &cmd, sizeof(cmd));
+	c->len += sizeof(cmd);
+	if (len)
+		memcpy(c->buf + c->len, arg, len);
+	c->len += len;
+}
+
+static void cmd_free_buffer(struct cmd_buf *c, binder_uintptr_t buffer)
+{
+	cmd_put(c, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+static void cmd_transaction(struct cmd_buf *c, uint32_t cmd, __u32 handle,
+			    __u32 code, const void *data, size_t size,
+			    const binder_size_t *offsets, size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = (uintptr_t)data;
+	tr.data.ptr.offsets = (uintptr_t)offsets;
+	cmd_put(c, cmd, &tr, sizeof(tr));
+}
+
+/*
+ * Handle the bookkeeping commands every process sees and return the
+ * first BR_TRANSACTION or BR_REPLY in @tr, or 0 when the read buffer is
+ * used up. Strong and weak references to local objects are acknowledged
+ * right away.
+ */
+static uint32_t parse_reads(int fd, char **pos, char *end,
+			    struct binder_transaction_data *tr)
+{
+	struct binder_ptr_cookie *pc;
+	struct cmd_buf ack;
+	uint32_t cmd;
+
+	while (*pos + sizeof(cmd) <= end) {
+		memcpy(&cmd, *pos, sizeof(cmd));
+		*pos += sizeof(cmd);
+
+		switch (cmd) {
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, *pos, sizeof(*tr));
+			*pos += sizeof(*tr);
+			return cmd;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			pc = (struct binder_ptr_cookie *)*pos;
+			ack.len = 0;
+			cmd_put(&ack, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+				BC_ACQUIRE_DONE, pc, sizeof(*pc));
+			binder_write(fd, ack.buf, ack.len);
+			break;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+		case BR_ERROR:
+			fprintf(stderr, "binder: transaction failed (%#x)\n",
+				cmd);
+			exit(1);
+		default:
+			break;
+		}
+		*pos += _IOC_SIZE(cmd);
+	}
+
+	return 0;
+}
+
+/* Send @c and wait for the BR_REPLY of a synchronous transaction */
+static void binder_call(int fd, struct cmd_buf *c,
+			struct binder_transaction_data *reply)
+{
+	struct binder_write_read bwr;
+	char rbuf[256], *pos;
+	uint32_t cmd;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = c->len;
+	bwr.write_buffer = (uintptr_t)c->buf;
+	for (;;) {
+		bwr.read_size = sizeof(rbuf);
+		bwr.read_consumed = 0;
+		bwr.read_buffer = (uintptr_t)rbuf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("BINDER_WRITE_READ");
+			exit(1);
+		}
+		bwr.write_size = 0;
+
+		pos = rbuf;
+		while ((cmd = parse_reads(fd, &pos, rbuf + bwr.read_consumed,
+					  reply)))
+			if (cmd == BR_REPLY)
+				return;
+	}
+}
+
+/* Serve transactions forever; @handler builds the reply */
+static void binder_loop(int fd, void (*handler)(int fd,
+				struct binder_transaction_data *tr,
+				struct cmd_buf *c))
+{
+	struct binder_transaction_data tr;
+	struct binder_write_read bwr;
+	struct cmd_buf c;
+	char rbuf[256], *pos;
+	uint32_t cmd = BC_ENTER_LOOPER;
+
+	binder_write(fd, &cmd, sizeof(cmd));
+	for (;;) {
+		memset(&bwr, 0, sizeof(bwr));
+		bwr.read_size = sizeof(rbuf);
+		bwr.read_buffer = (uintptr_t)rbuf;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		pos = rbuf;
+		while (parse_reads(fd, &pos, rbuf + bwr.read_consumed, &tr)) {
+			c.len = 0;
+			handler(fd, &tr, &c);
+			binder_write(fd, c.buf, c.len);
+		}
+	}
+}
+
+/* ---- context manager ---- */
+
+static __u32 handles[MAX_PAIRS];
+static int registered[MAX_PAIRS];
+
+/* Lookup replies are written after the handler returns */
+static struct {
+	__u32 idx;
+	struct flat_binder_object obj;
+} __attribute__((packed)) lookup_reply;
+
+static void registry_handler(int fd, struct binder_transaction_data *tr,
+			     struct cmd_buf *c)
+{
+	const char *data = (const char *)(uintptr_t)tr->data.ptr.buffer;
+	struct flat_binder_object obj;
+	struct cmd_buf refs;
+	static binder_size_t offset = sizeof(__u32);
+	__u32 idx;
+
+	memcpy(&idx, data, sizeof(idx));
+	if (idx >= MAX_PAIRS)
+		idx = 0;
+
+	if (tr->code == CODE_REGISTER) {
+		memcpy(&obj, data + sizeof(idx), sizeof(obj));
+		/* Keep the reference once the transaction buffer is freed */
+		refs.len = 0;
+		cmd_put(&refs, BC_INCREFS, &obj.handle, sizeof(obj.handle));
+		cmd_put(&refs, BC_ACQUIRE, &obj.handle, sizeof(obj.handle));
+		binder_write(fd, refs.buf, refs.len);
+		handles[idx] = obj.handle;
+		registered[idx] = 1;
+		cmd_free_buffer(c, tr->data.ptr.buffer);
+		cmd_transaction(c, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+		return;
+	}
+
+	cmd_free_buffer(c, tr->data.ptr.buffer);
+	if (tr->code != CODE_LOOKUP || !registered[idx]) {
+		cmd_transaction(c, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+		return;
+	}
+
+	memset(&lookup_reply, 0, sizeof(lookup_reply));
+	lookup_reply.idx = idx;
+	lookup_reply.obj.type = BINDER_TYPE_HANDLE;
+	lookup_reply.obj.handle = handles[idx];
+	cmd_transaction(c, BC_REPLY, 0, 0, &lookup_reply, sizeof(lookup_reply),
+			&offset, sizeof(offset));
+}
+
+static void *registry_thread(void *arg)
+{
+	binder_loop(*(int *)arg, registry_handler);
+	return NULL;
+}
+
+/* ---- receiver ---- */
+
+static void receiver_handler(int fd, struct binder_transaction_data *tr,
+			     struct cmd_buf *c)
+{
+	cmd_free_buffer(c, tr->data.ptr.buffer);
+	cmd_transaction(c, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+}
+
+static void run_receiver(__u32 idx)
+{
+	struct binder_transaction_data reply;
+	static binder_size_t offset = sizeof(__u32);
+	struct {
+		__u32 idx;
+		struct flat_binder_object obj;
+	} __attribute__((packed)) data;
+	struct cmd_buf c;
+	int fd;
+
+	while (!shared->mgr_ready)
+		usleep(1000);
+
+	fd = binder_open();
+	if (fd < 0) {
+		perror(BINDER_DEV);
+		exit(1);
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.idx = idx;
+	data.obj.type = BINDER_TYPE_BINDER;
+	data.obj.flags = FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	data.obj.binder = idx + 1;
+	data.obj.cookie = idx + 1;
+
+	c.len = 0;
+	cmd_transaction(&c, BC_TRANSACTION, 0, CODE_REGISTER, &data,
+			sizeof(data), &offset, sizeof(offset));
+	binder_call(fd, &c, &reply);
+	c.len = 0;
+	cmd_free_buffer(&c, reply.data.ptr.buffer);
+	binder_write(fd, c.buf, c.len);
+
+	binder_loop(fd, receiver_handler);
+	exit(0);
+}
+
+/* ---- sender ---- */
+
+static __u32 lookup(int fd, __u32 idx)
+{
+	struct binder_transaction_data reply;
+	struct flat_binder_object obj;
+	struct cmd_buf c;
+
+	for (;;) {
+		c.len = 0;
+		cmd_transaction(&c, BC_TRANSACTION, 0, CODE_LOOKUP, &idx,
+				sizeof(idx), NULL, 0);
+		binder_call(fd, &c, &reply);
+
+		if (reply.data_size >= sizeof(idx) + sizeof(obj)) {
+			memcpy(&obj, (char *)(uintptr_t)reply.data.ptr.buffer +
+			       sizeof(idx), sizeof(obj));
+			c.len = 0;
+			cmd_put(&c, BC_ACQUIRE, &obj.handle, sizeof(obj.handle));
+			cmd_free_buffer(&c, reply.data.ptr.buffer);
+			binder_write(fd, c.buf, c.len);
+			return obj.handle;
+		}
+
+		c.len = 0;
+		cmd_free_buffer(&c, reply.data.ptr.buffer);
+		binder_write(fd, c.buf, c.len);
+		usleep(1000);
+	}
+}
+
+static void run_sender(__u32 idx)
+{
+	struct binder_transaction_data reply;
+	static char data[MAX_PAYLOAD];
+	unsigned long long end, n = 0;
+	struct cmd_buf c;
+	__u32 handle;
+	int fd;
+
+	while (!shared->mgr_ready)
+		usleep(1000);
+
+	fd = binder_open();
+	if (fd < 0) {
+		perror(BINDER_DEV);
+		exit(1);
+	}
+
+	handle = lookup(fd, idx);
+	__sync_fetch_and_add(&shared->ready, 1);
+	while (!shared->start)
+		usleep(100);
+
+	end = now_ns() + duration * 1000000000ULL;
+	while (now_ns() < end) {
+		c.len = 0;
+		cmd_transaction(&c, BC_TRANSACTION, handle, CODE_PING, data,
+				payload, NULL, 0);
+		binder_call(fd, &c, &reply);
+		c.len = 0;
+		cmd_free_buffer(&c, reply.data.ptr.buffer);
+		binder_write(fd, c.buf, c.len);
+		n++;
+	}
+
+	shared->count[idx] = n;
+	exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p pairs] [-d seconds] [-s payload]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pid_t receivers[MAX_PAIRS], senders[MAX_PAIRS];
+	unsigned long long total = 0;
+	pthread_t registry;
+	int fd, i, opt, status, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:d:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (pairs <= 0 || pairs > MAX_PAIRS || duration <= 0 ||
+	    payload < 0 || payload > MAX_PAYLOAD)
+		usage(argv[0]);
+
+	if (access(BINDER_DEV, R_OK | W_OK)) {
+		printf("binder_bench: %s not available, skipping\n",
+		       BINDER_DEV);
+		return 0;
+	}
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		return 1;
+
+	/* Fork first, so that no child shares the context manager's fd */
+	for (i = 0; i < pairs; i++) {
+		receivers[i] = fork();
+		if (!receivers[i])
+			run_receiver(i);
+	}
+	for (i = 0; i < pairs; i++) {
+		senders[i] = fork();
+		if (!senders[i])
+			run_sender(i);
+	}
+
+	fd = binder_open();
+	if (fd < 0 || ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("binder_bench: context manager");
+		ret = 1;
+		goto out;
+	}
+	pthread_create(&registry, NULL, registry_thread, &fd);
+	shared->mgr_ready = 1;
+
+	while (shared->ready < pairs)
+		usleep(1000);
+	shared->start = 1;
+
+	for (i = 0; i < pairs; i++) {
+		waitpid(senders[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+	for (i = 0; i < pairs; i++) {
+		kill(receivers[i], SIGKILL);
+		waitpid(receivers[i], NULL, 0);
+	}
+	if (ret)
+		return ret;
+
+	for (i = 0; i < pairs; i++) {
+		printf("pair %d: %llu transactions/s\n", i,
+		       shared->count[i] / duration);
+		total += shared->count[i];
+	}
+	printf("%d pairs, %d byte payload: %llu transactions/s\n",
+	       pairs, payload, total / duration);
+	return 0;
+
+out:
+	for (i = 0; i < pairs; i++) {
+		kill(receivers[i], SIGKILL);
+		kill(senders[i], SIGKILL);
+	}
+	while (wait(NULL) > 0)
+		;
+	return ret;
+}
@@ -0,0 +1,383 @@
+/*
+ * energy_bench - compare energy-aware and HMP task placement
+ *
+ * Runs a set of periodic, rt-app style tasks once with
+ * kernel.sched_enable_energy_aware off and once with it on, and reports
+ * for each placement:
+ *
+ *  - wakeup latency: how late each period started versus its deadline,
+ *  - where the tasks ran, per CPU,
+ *  - the energy delta the model charged for the chosen CPUs, summed from
+ *    the sched_energy_diff trace event (energy-aware placement only),
+ *  - measured energy, if the battery exposes current_now/voltage_now.
+ *
+ * Tasks are described as name:threads:period_us:run_us, e.g.
+ *
+ *	energy_bench -d 10 -t audio:1:10000:1500 -t ui:4:16666:4000
+ *
+ * Needs root, debugfs on /sys/kernel/debug and CONFIG_SCHED_HMP.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define SYSCTL_EA	"/proc/sys/kernel/sched_enable_energy_aware"
+#define TRACING		"/sys/kernel/debug/tracing/"
+#define BATTERY		"/sys/class/power_supply/battery/"
+
+#define MAX_TASKS	16
+#define MAX_THREADS	64
+#define MAX_CPUS	64
+#define POWER_SAMPLE_MS	100
+
+struct task_desc {
+	char name[16];
+	int threads;
+	long period_us;
+	long run_us;
+};
+
+struct thread_stats {
+	struct task_desc *desc;
+	pid_t tid;
+	unsigned long wakeups;
+	unsigned long long lat_total_ns;
+	unsigned long long lat_max_ns;
+	unsigned long cpu_runs[MAX_CPUS];
+};
+
+struct run_result {
+	unsigned long wakeups;
+	unsigned long long lat_total_ns;
+	unsigned long long lat_max_ns;
+	unsigned long cpu_runs[MAX_CPUS];
+	long long model_delta;
+	unsigned long model_wakeups;
+	double energy_mj;
+	int have_energy;
+};
+
+static struct task_desc tasks[MAX_TASKS];
+static int nr_tasks;
+static struct thread_stats stats[MAX_THREADS];
+static int nr_threads;
+static volatile int stop;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ns_to_ts(unsigned long long ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, val, strlen(val)) < 0 ? -errno : 0;
+	close(fd);
+	return ret;
+}
+
+static long long read_ll(const char *path)
+{
+	char buf[32];
+	long long val;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	if (sscanf(buf, "%lld", &val) != 1)
+		return -1;
+	return val;
+}
+
+static void *task_fn(void *arg)
+{
+	struct thread_stats *st = arg;
+	unsigned long long next, start, late;
+	struct timespec ts;
+	int cpu;
+
+	st->tid = syscall(SYS_gettid);
+	next = now_ns();
+	while (!stop) {
+		/* Busy for run_us, then sleep until the next period */
+		start = now_ns();
+		while (now_ns() - start < st->desc->run_us * 1000ULL)
+			;
+
+		next += st->desc->period_us * 1000ULL;
+		ns_to_ts(next, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		late = now_ns() - next;
+		st->wakeups++;
+		st->lat_total_ns += late;
+		if (late > st->lat_max_ns)
+			st->lat_max_ns = late;
+		cpu = sched_getcpu();
+		if (cpu >= 0 && cpu < MAX_CPUS)
+			st->cpu_runs[cpu]++;
+	}
+
+	return NULL;
+}
+
+static struct thread_stats *find_thread(pid_t tid)
+{
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		if (stats[i].tid == tid)
+			return &stats[i];
+	return NULL;
+}
+
+/*
+ * energy_aware_cpu() traces one sched_energy_diff per candidate CPU and
+ * the wakeup then reports the CPU it picked; charge that CPU's delta.
+ */
+static void parse_trace(struct run_result *res)
+{
+	static long long delta[MAX_THREADS][MAX_CPUS];
+	static char seen[MAX_THREADS][MAX_CPUS];
+	struct thread_stats *st;
+	char line[512], *p;
+	long long d;
+	int pid, cpu, idx;
+	FILE *f;
+
+	memset(seen, 0, sizeof(seen));
+	f = fopen(TRACING "trace", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		p = strstr(line, "sched_energy_diff: ");
+		if (p) {
+			if (sscanf(p, "sched_energy_diff: %d (%*[^)]): cpu=%d tload=%*u energy_delta=%lld",
+				   &pid, &cpu, &d) != 3)
+				continue;
+			st = find_thread(pid);
+			if (!st || cpu < 0 || cpu >= MAX_CPUS)
+				continue;
+			idx = st - stats;
+			delta[idx][cpu] = d;
+			seen[idx][cpu] = 1;
+			continue;
+		}
+
+		p = strstr(line, "sched_wakeup");
+		if (!p || !(p = strstr(p, " pid=")))
+			continue;
+		if (sscanf(p, " pid=%d", &pid) != 1)
+			continue;
+		p = strstr(p, "target_cpu=");
+		if (!p || sscanf(p, "target_cpu=%d", &cpu) != 1)
+			continue;
+		st = find_thread(pid);
+		if (!st || cpu < 0 || cpu >= MAX_CPUS)
+			continue;
+		idx = st - stats;
+		if (seen[idx][cpu]) {
+			res->model_delta += delta[idx][cpu];
+			res->model_wakeups++;
+		}
+		memset(seen[idx], 0, sizeof(seen[idx]));
+	}
+
+	fclose(f);
+}
+
+static int run_once(int energy_aware, int duration, struct run_result *res)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long long end;
+	long long ua, uv;
+	int i, j, t = 0;
+
+	memset(res, 0, sizeof(*res));
+	memset(stats, 0, sizeof(stats));
+
+	if (write_file(SYSCTL_EA, energy_aware ? "1" : "0")) {
+		fprintf(stderr, "can't set %s\n", SYSCTL_EA);
+		return -1;
+	}
+	write_file(TRACING "trace", "");
+	write_file(TRACING "events/sched/sched_energy_diff/enable", "1");
+	write_file(TRACING "events/sched/sched_wakeup/enable", "1");
+	write_file(TRACING "tracing_on", "1");
+
+	stop = 0;
+	for (i = 0; i < nr_tasks; i++) {
+		for (j = 0; j < tasks[i].threads; j++, t++) {
+			stats[t].desc = &tasks[i];
+			if (pthread_create(&threads[t], NULL, task_fn,
+					   &stats[t])) {
+				stop = 1;
+				nr_threads = t;
+				goto join;
+			}
+		}
+	}
+	nr_threads = t;
+
+	res->have_energy = read_ll(BATTERY "current_now") >= 0 &&
+			   read_ll(BATTERY "voltage_now") >= 0;
+	end = now_ns() + duration * 1000000000ULL;
+	while (now_ns() < end) {
+		usleep(POWER_SAMPLE_MS * 1000);
+		if (!res->have_energy)
+			continue;
+		ua = llabs(read_ll(BATTERY "current_now"));
+		uv = read_ll(BATTERY "voltage_now");
+		/* uA * uV is pW; over POWER_SAMPLE_MS that is pJ / 1000 */
+		res->energy_mj += (double)ua * uv * POWER_SAMPLE_MS / 1e15;
+	}
+	stop = 1;
+
+join:
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	write_file(TRACING "tracing_on", "0");
+	parse_trace(res);
+	write_file(TRACING "events/sched/sched_energy_diff/enable", "0");
+	write_file(TRACING "events/sched/sched_wakeup/enable", "0");
+
+	for (i = 0; i < nr_threads; i++) {
+		res->wakeups += stats[i].wakeups;
+		res->lat_total_ns += stats[i].lat_total_ns;
+		if (stats[i].lat_max_ns > res->lat_max_ns)
+			res->lat_max_ns = stats[i].lat_max_ns;
+		for (j = 0; j < MAX_CPUS; j++)
+			res->cpu_runs[j] += stats[i].cpu_runs[j];
+	}
+
+	return t == nr_threads ? 0 : -1;
+}
+
+static void report(const char *name, struct run_result *res)
+{
+	int cpu;
+
+	printf("%s placement:\n", name);
+	printf("  wakeups %lu latency avg %llu us max %llu us\n",
+	       res->wakeups,
+	       res->wakeups ? res->lat_total_ns / res->wakeups / 1000 : 0,
+	       res->lat_max_ns / 1000);
+	printf("  runs per cpu:");
+	for (cpu = 0; cpu < MAX_CPUS; cpu++)
+		if (res->cpu_runs[cpu])
+			printf(" %d:%lu", cpu, res->cpu_runs[cpu]);
+	printf("\n");
+	if (res->model_wakeups)
+		printf("  model energy delta %lld over %lu placements\n",
+		       res->model_delta, res->model_wakeups);
+	if (res->have_energy)
+		printf("  measured energy %.1f mJ\n", res->energy_mj);
+}
+
+static int parse_task(const char *arg)
+{
+	struct task_desc *desc = &tasks[nr_tasks];
+
+	if (nr_tasks == MAX_TASKS)
+		return -1;
+	if (sscanf(arg, "%15[^:]:%d:%ld:%ld", desc->name, &desc->threads,
+		   &desc->period_us, &desc->run_us) != 4)
+		return -1;
+	if (desc->threads <= 0 || desc->period_us <= 0 ||
+	    desc->run_us < 0 || desc->run_us > desc->period_us)
+		return -1;
+	nr_tasks++;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d seconds] [-t name:threads:period_us:run_us]...\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct run_result hmp, eas;
+	long long saved;
+	int duration = 5;
+	int i, total = 0, opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			duration = atoi(optarg);
+			if (duration <= 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			if (parse_task(optarg))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* Default: a light periodic task next to a bursty multi-thread one */
+	if (!nr_tasks) {
+		parse_task("light:2:10000:1000");
+		parse_task("heavy:2:16666:8000");
+	}
+
+	for (i = 0; i < nr_tasks; i++)
+		total += tasks[i].threads;
+	if (total > MAX_THREADS) {
+		fprintf(stderr, "at most %d threads\n", MAX_THREADS);
+		return 1;
+	}
+
+	saved = read_ll(SYSCTL_EA);
+	if (saved < 0) {
+		printf("energy_bench: %s not available, skipping\n", SYSCTL_EA);
+		return 0;
+	}
+
+	ret = run_once(0, duration, &hmp);
+	if (!ret)
+		ret = run_once(1, duration, &eas);
+	write_file(SYSCTL_EA, saved ? "1" : "0");
+	if (ret) {
+		fprintf(stderr, "energy_bench: run failed\n");
+		return 1;
+	}
+
+	report("HMP", &hmp);
+	report("Energy-aware", &eas);
+	return 0;
+}